@@ -1,3 +1,138 @@
+// -----------------------------------------------------------------
+// Addon.SPI: SD-карта
+// -----------------------------------------------------------------
+
+// Образ карты (-D, по умолчанию sd.img) открывается один раз при первой
+// команде и читается через кэш секторов: SPI_CACHE последних секторов,
+// вытесняется давно не использованный. Запись остается в кэше и уходит
+// в образ при вытеснении, через SPI_FLUSH_FRAMES кадров после первой
+// несброшенной записи и при выходе.
+// Карта - SDHC: адрес в командах - номер сектора, размер - в CSD v2.
+
+// Позиция в образе: больше 2 Гб не помещается в long
+static int spi_seek(FILE* fp, long long pos) {
+#ifdef _WIN32
+    return _fseeki64(fp, pos, SEEK_SET);
+#else
+    return fseeko(fp, pos, SEEK_SET);
+#endif
+}
+
+// Открыть образ; нет образа - карта не вставлена и на команды не отвечает
+int Z80Spectrum::spi_open() {
+
+    if (spi_card) return spi_card > 0;
+
+    spi_file = fopen(spi_image, "r+b");
+
+    if (spi_file == NULL) {
+
+        printf("SD card image %s not found\n", spi_image);
+        spi_card = -1;
+        return 0;
+    }
+
+#ifdef _WIN32
+    _fseeki64(spi_file, 0, SEEK_END);
+    spi_sectors = _ftelli64(spi_file) / 512;
+#else
+    fseeko(spi_file, 0, SEEK_END);
+    spi_sectors = ftello(spi_file) / 512;
+#endif
+
+    spi_card = 1;
+    return 1;
+}
+
+// Измененный сектор - в образ
+void Z80Spectrum::spi_store(SpiLine& line) {
+
+    spi_seek(spi_file, (long long) line.lba * 512);
+    (void) fwrite(line.data, 1, 512, spi_file);
+
+    line.dirty = 0;
+    spi_dirty--;
+}
+
+// Сектор через кэш; промах вытесняет давно не использованный
+SpiLine* Z80Spectrum::spi_line(int lba) {
+
+    SpiLine* victim = spi_cache;
+
+    spi_tick++;
+
+    for (int _i = 0; _i < SPI_CACHE; _i++) {
+
+        SpiLine& line = spi_cache[_i];
+
+        if (line.lba == lba) { line.used = spi_tick; return &line; }
+        if (line.used < victim->used) victim = &line;
+    }
+
+    if (victim->dirty) spi_store(*victim);
+
+    victim->lba  = lba;
+    victim->used = spi_tick;
+
+    spi_seek(spi_file, (long long) lba * 512);
+    if (fread(victim->data, 1, 512, spi_file) != 512) memset(victim->data, 0, 512);
+
+    return victim;
+}
+
+// Все измененные сектора - в образ
+void Z80Spectrum::spi_flush() {
+
+    for (int _i = 0; _i < SPI_CACHE; _i++) {
+        if (spi_cache[_i].dirty) spi_store(spi_cache[_i]);
+    }
+
+    fflush(spi_file);
+    spi_frames = 0;
+}
+
+// Конец кадра: записи не лежат в кэше дольше SPI_FLUSH_FRAMES кадров
+void Z80Spectrum::spi_timer() {
+
+    if (++spi_frames >= SPI_FLUSH_FRAMES) spi_flush();
+}
+
+// Принятый блок (spi_sector) - в сектор spi_lba
+void Z80Spectrum::spi_put_sector() {
+
+    SpiLine* line = spi_line(spi_lba);
+
+    memcpy(line->data, spi_sector, 512);
+
+    if (!line->dirty) spi_dirty++;
+    line->dirty = 1;
+}
+
+// CSD v2 (SDHC): C_SIZE - размер в блоках по 512К минус один
+void Z80Spectrum::spi_csd(unsigned char* csd) {
+
+    static const unsigned char base[16] = { 0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
+                                            0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01 };
+
+    long long size = spi_sectors / 1024;
+    int c_size = size > 0 ? (int)(size - 1) : 0;
+
+    memcpy(csd, base, 16);
+
+    csd[7] = (c_size >> 16) & 0x3F;
+    csd[8] = (c_size >> 8) & 0xFF;
+    csd[9] =  c_size & 0xFF;
+}
+
+// Хост нарушил протокол (пишет, пока карта отвечает, или нет маркера
+// данных): передача прерывается, на следующее чтение - R1 "illegal command"
+void Z80Spectrum::spi_abort() {
+
+    spi_status = 0;
+    spi_resp   = 0x04;
+    spi_data   = 0xFF;
+}
+
 // Сохранение данных
 void Z80Spectrum::spi_write_data(unsigned char data) {
     spi_data = data;
@@ -17,6 +152,9 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
     // data = 1
     else {
 
+        // Команда посреди многоблочного чтения (CMD12) - сразу на прием
+        if (spi_status == 7 && (spi_data & 0xC0) == 0x40) spi_status = 0;
+
         switch (spi_status) {
 
             // IDLE
@@ -51,15 +189,28 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
                     spi_phase = 0;
                     spi_crc   = spi_data;
 
+                    int lba_ok = spi_open() && (unsigned int) spi_arg < spi_sectors;
+
                     /* Ответ зависит от команды */
-                    switch (spi_command) {
+                    if (spi_card < 0) {
+                        spi_status = 0; spi_resp = 0xFF;    // Карты нет
+                    }
+                    else if ((spi_command == 17 || spi_command == 18 || spi_command == 24 || spi_command == 25) && !lba_ok) {
+                        spi_status = 0; spi_resp = 0x20;    // ADDRESS ERROR
+                    }
+                    else switch (spi_command) {
 
                         /* CMDxx */
                         case 0:  spi_status = 0; spi_resp = 0x01; break;
                         case 8:  spi_status = 2; spi_resp = 0x00; break;
+                        case 9:  spi_status = 9; spi_csd(spi_sector); break; // CSD
+                        case 12: spi_status = 0; spi_resp = 0x00; break;    // STOP TRANSMISSION
                         case 13: spi_status = 6; spi_resp = 0x00; break;    // STATUS
+                        case 16: spi_status = 0; spi_resp = 0x00; break;    // BLOCKLEN: всегда 512
                         case 17: spi_status = 4; spi_lba  = spi_arg; break; // BLOCK SEARCH READ
+                        case 18: spi_status = 7; spi_lba  = spi_arg; break; // MULTIPLE READ
                         case 24: spi_status = 5; spi_lba  = spi_arg; break; // BLOCK SEARCH WRITE
+                        case 25: spi_status = 8; spi_lba  = spi_arg; break; // MULTIPLE WRITE
                         case 41: spi_status = 0; spi_resp = 0x00; break;    // READY=0
                         case 55: spi_status = 0; spi_resp = 0x01; break;    // ACMD=1
                         case 58: spi_status = 3; spi_resp = 0x00; break;    // CHECK=0
@@ -86,9 +237,7 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
 
                     spi_phase++;
                 }
-                else {
-                    printf("SPI Illegal Write #1"); exit(1);
-                }
+                else spi_abort();
 
                 break;
             }
@@ -111,9 +260,7 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
 
                     spi_phase++;
 
-                } else {
-                    printf("SPI Illegal Write #2"); exit(1);
-                }
+                } else spi_abort();
 
                 break;
             }
@@ -124,11 +271,7 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
                 if (spi_phase == 0) {
 
                     spi_data = 0x00;
-                    spi_file = fopen("sd.img", "ab+");
-                    if (spi_file == NULL) { printf("Error open file\n"); exit(0); }
-                    fseek(spi_file, 512 * spi_lba, SEEK_SET);
-                    (void) fread(spi_sector, 1, 512, spi_file);
-                    fclose(spi_file);
+                    memcpy(spi_sector, spi_line(spi_lba)->data, 512);
 
                 } else if (spi_phase == 1) {
                     spi_data = 0xFE;
@@ -154,9 +297,9 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
 
                 } else if (spi_phase == 1) {
 
-                    if (spi_data != 0xFE) {
-                        printf("Illegal opcode (non FE)\n"); exit(1);
-                    }
+                    // До маркера FE хост может слать FF
+                    if (spi_data == 0xFF) break;
+                    if (spi_data != 0xFE) { spi_abort(); break; }
 
                 } else if (spi_phase < 514) {
                     spi_sector[spi_phase - 2] = spi_data;
@@ -170,18 +313,13 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
 
                 spi_phase++;
 
-                // Окончание программирования
+                // Окончание программирования: сектор - в кэш
                 if (spi_phase == 520) {
 
                     spi_status = 0;
                     spi_resp   = 0x00;
 
-                    // Запись новых данных на диск
-                    spi_file = fopen("sd.img", "r+b");
-                    if (spi_file == NULL) { printf("Error open file\n"); exit(0); }
-                    fseek(spi_file, 512 * spi_lba, SEEK_SET);
-                    (void) fwrite(spi_sector, 1, 512, spi_file);
-                    fclose(spi_file);
+                    spi_put_sector();
                 }
 
                 break;
@@ -198,9 +336,103 @@ void Z80Spectrum::spi_write_cmd(unsigned char data) {
                     spi_data = 0x00;
                     spi_phase++;
                 }
-                else {
-                    printf("SPI Illegal Write #1"); exit(1);
+                else spi_abort();
+
+                break;
+            }
+
+            // Многоблочное чтение до CMD12: R1, затем блоки FE, 512 байт, CRC
+            case 7: {
+
+                if (spi_phase == 0) {
+                    spi_data = 0x00;
+                } else if (spi_phase == 1) {
+
+                    // Конец карты: дальше только FF до CMD12
+                    if ((unsigned int) spi_lba >= spi_sectors) { spi_data = 0xFF; break; }
+
+                    memcpy(spi_sector, spi_line(spi_lba)->data, 512);
+                    spi_data = 0xFE;
+
+                } else if (spi_phase < 514) {
+                    spi_data = spi_sector[spi_phase - 2];
+                } else {
+                    spi_data = 0xFF;
+                }
+
+                spi_phase++;
+
+                // Следующий блок
+                if (spi_phase == 516) {
+
+                    spi_phase = 1;
+                    spi_lba++;
+                }
+
+                break;
+            }
+
+            // Многоблочная запись: R1, затем блоки FC, 512 байт, CRC - ответ 05;
+            // FD - конец передачи
+            case 8: {
+
+                if (spi_phase == 0) {
+
+                    spi_data  = 0x00;
+                    spi_phase = 1;
+
+                } else if (spi_phase == 1) {
+
+                    if (spi_data == 0xFC) spi_phase = 2;
+                    else if (spi_data == 0xFD) { spi_status = 0; spi_resp = 0x00; }
+
+                    spi_data = 0xFF;
+
+                } else if (spi_phase < 514) {
+
+                    spi_sector[spi_phase - 2] = spi_data;
+                    spi_data = 0xFF;
+                    spi_phase++;
+
+                } else if (spi_phase < 516) {
+
+                    spi_data = 0xFF;
+                    spi_phase++;
+
+                } else {
+
+                    // Блок принят
+                    spi_data  = 0x05;
+                    spi_phase = 1;
+
+                    if ((unsigned int) spi_lba < spi_sectors) spi_put_sector();
+                    spi_lba++;
+                }
+
+                break;
+            }
+
+            // CSD: R1, FE, 16 байт, CRC
+            case 9: {
+
+                if (spi_phase == 0) {
+                    spi_data = 0x00;
+                } else if (spi_phase == 1) {
+                    spi_data = 0xFE;
+                } else if (spi_phase < 18) {
+                    spi_data = spi_sector[spi_phase - 2];
+                } else {
+                    spi_data = 0xFF;
                 }
+
+                spi_phase++;
+                if (spi_phase == 20) {
+
+                    spi_status = 0;
+                    spi_resp   = 0xFF;
+                }
+
+                break;
             }
         }
     }
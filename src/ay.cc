@@ -9,15 +9,79 @@
 // Звук
 // -----------------------------------------------------------------
 
-// Запись данных в регистр
+// Запись данных в регистр: запоминается с тактом, применяется при синтезе
 void Z80Spectrum::ay_write_data(int data) {
 
-    int reg_id  = ay_register & 15;
-    int tone_id = reg_id >> 1;
-
     ay_last_data = data;
 
-    ay_regs[reg_id] = data;
+    if (psg_file && ay_sel == 0) psg_write(ay_register & 15, data);
+    if (aev_file) aev_put((ay_sel << 4) | (ay_register & 15), data, t_states_cycle);
+
+    // Звук никуда не выводится - состояние генераторов не нужно
+    if (!ay_synth) {
+
+        ay_apply(ay[ay_sel], ay_register & 15, data);
+        return;
+    }
+
+    if (ay_event_count == AY_EVENTS) ay_sync(t_states_cycle);
+
+    AYEvent& ev = ay_events[ay_event_count++];
+
+    ev.t    = t_states_cycle;
+    ev.reg  = (ay_sel << 4) | (ay_register & 15);
+    ev.data = data;
+}
+
+// TurboSound: запись 0xFF/0xFE в порт адреса выбирает чип 0/1. У каждого
+// чипа свой регистр адреса; второй чип микшируется после первого выбора
+void Z80Spectrum::ay_select(int data) {
+
+    if (data == 0xFF || data == 0xFE) {
+
+        ay[ay_sel].latch = ay_register;
+        ay_sel           = 0xFF - data;
+        ay_register      = ay[ay_sel].latch;
+
+        if (ay_sel) ay_chips = 2;
+    }
+    else {
+        ay_register = data & 15;
+    }
+}
+
+// Оба чипа AY и бипер в исходном состоянии, очереди записей пусты
+void Z80Spectrum::ay_reset() {
+
+    for (int _c = 0; _c < 2; _c++) {
+
+        AYChip& c = ay[_c];
+
+        memset(&c, 0, sizeof(AYChip));
+        for (int _f = 0; _f < 3; _f++) c.tone_period[_f] = 1;
+
+        c.regs[7]   = 0xff;
+        c.rng       = 1;
+        c.env_first = 1;
+        c.dirty     = 1;
+    }
+
+    ay_sel         = 0;
+    ay_chips       = 1;
+    ay_t_pos       = 0;
+    ay_event_count = 0;
+
+    beep_level      = 0;
+    beep_edge_count = 0;
+}
+
+// Применить запись к регистрам и счетчикам
+void Z80Spectrum::ay_apply(AYChip& c, int reg_id, int data) {
+
+    int tone_id = reg_id >> 1;
+
+    c.regs[reg_id] = data;
+    c.dirty        = 1;
 
     switch (reg_id) {
 
@@ -27,119 +91,124 @@ void Z80Spectrum::ay_write_data(int data) {
         case 4: case 5:
 
             // Получение значения тона из регистров AY
-            ay_tone_period[tone_id] = (ay_regs[reg_id&~1] + 256*(ay_regs[reg_id&~1|1] & 15));
+            c.tone_period[tone_id] = (c.regs[reg_id&~1] + 256*(c.regs[reg_id&~1|1] & 15));
 
-            if (ay_tone_period[tone_id] == 0) {
-                ay_tone_period[tone_id] = 1;
+            if (c.tone_period[tone_id] == 0) {
+                c.tone_period[tone_id] = 1;
             }
 
             // Это типа чтобы звук не был такой обалдевший
-            if (ay_tone_tick[tone_id] >= ay_tone_period[tone_id]*2)
-                ay_tone_tick[tone_id] %= ay_tone_period[tone_id]*2;
+            if (c.tone_tick[tone_id] >= c.tone_period[tone_id]*2)
+                c.tone_tick[tone_id] %= c.tone_period[tone_id]*2;
 
             break;
 
         // Сброс шума
         case 6:
 
-            ay_noise_tick   = 0;
-            ay_noise_period = ay_regs[6] & 31;
+            c.noise_tick   = 0;
+            c.noise_period = c.regs[6] & 31;
             break;
 
         // Период огибающей
         case 11: case 12:
 
-            ay_env_period = ay_regs[11] | (ay_regs[12] << 8);
+            c.env_period = c.regs[11] | (c.regs[12] << 8);
             break;
 
         // Запись команды для огибающей
         case 13:
 
-            ay_env_first = 1;
-            ay_env_rev = 0;
-            ay_env_internal_tick = ay_env_tick = ay_env_cycles = 0;
-            ay_env_counter = (ay_regs[13] & AY_ENV_ATTACK) ? 0 : 15;
+            c.env_first = 1;
+            c.env_rev = 0;
+            c.env_internal_tick = c.env_tick = c.env_cycles = 0;
+            c.env_counter = (c.regs[13] & AY_ENV_ATTACK) ? 0 : 15;
             break;
     }
 }
 
-// Тикер каждые 32 такта
-void Z80Spectrum::ay_tick() {
+// Один шаг огибающей
+void Z80Spectrum::ay_env_step(AYChip& c, int envshape) {
 
-    int mixer       = ay_regs[7];
-    int envshape    = ay_regs[13];
-    int noise_count = 1;
+    // Выполнить первые 1/16 периодический INC/DEC если нужно
+    // 1. Это первая запись в регистр r13
+    // 2. Или это Cont=1 и Hold=0
+    if (c.env_first || ((envshape & AY_ENV_CONT) && !(envshape & AY_ENV_HOLD))) {
 
-    // Задание уровней звука для тонов
-    int levels[3];
+        // Направление движения: вниз (ATTACK=1) или вверх
+        if (c.env_rev)
+             c.env_counter -= (envshape & AY_ENV_ATTACK) ? 1 : -1;
+        else c.env_counter += (envshape & AY_ENV_ATTACK) ? 1 : -1;
 
-    // Огибающая
-    int env_level = ay_tone_levels[ ay_env_counter ];
+        // Проверка на достижения предела
+        if      (c.env_counter <  0) c.env_counter = 0;
+        else if (c.env_counter > 15) c.env_counter = 15;
+    }
 
-    // Генерация начальных значений громкости
-    for (int n = 0; n < 3; n++) {
+    c.env_internal_tick++;
 
-        int g = ay_regs[8 + n];
+    // Срабатывает каждые 16 циклов AY
+    while (c.env_internal_tick >= 16) {
 
-        // Если 4-м бите громкости тона стоит единица, то взять громкость огибающей
-        levels[n] = ay_tone_levels[(g & 16 ? ay_env_counter : g) & 15];
-    }
+        c.env_internal_tick -= 16;
 
-    // Обработчик "огибающей" (envelope)
-    ay_env_tick++;
-    while (ay_env_tick >= ay_env_period) {
-
-        ay_env_tick -= ay_env_period;
+        // Конец цикла для CONT, если CONT=0, то остановка счетчика
+        if ((envshape & AY_ENV_CONT) == 0) {
+            c.env_counter = 0;
+        }
+        else {
 
-        // Выполнить первые 1/16 периодический INC/DEC если нужно
-        // 1. Это первая запись в регистр r13
-        // 2. Или это Cont=1 и Hold=0
-        if (ay_env_first || ((envshape & AY_ENV_CONT) && !(envshape & AY_ENV_HOLD))) {
+            // Опция HOLD=1
+            if (envshape & AY_ENV_HOLD) {
 
-            // Направление движения: вниз (ATTACK=1) или вверх
-            if (ay_env_rev)
-                 ay_env_counter -= (envshape & AY_ENV_ATTACK) ? 1 : -1;
-            else ay_env_counter += (envshape & AY_ENV_ATTACK) ? 1 : -1;
+                // Пилообразная фигура
+                if (c.env_first && (envshape & AY_ENV_ALT))
+                    c.env_counter = (c.env_counter ? 0 : 15);
+            }
+            // Опция HOLD=0
+            else {
 
-            // Проверка на достижения предела
-            if      (ay_env_counter <  0) ay_env_counter = 0;
-            else if (ay_env_counter > 15) ay_env_counter = 15;
+                if (envshape & AY_ENV_ALT)
+                     c.env_rev     = !c.env_rev;
+                else c.env_counter = (envshape & AY_ENV_ATTACK) ? 0 : 15;
+            }
         }
 
-        ay_env_internal_tick++;
+        c.env_first = 0;
+    }
+}
 
-        // Срабатывает каждые 16 циклов AY
-        while (ay_env_internal_tick >= 16) {
+// Тикер каждые 32 такта
+void Z80Spectrum::ay_tick(AYChip& c) {
 
-            ay_env_internal_tick -= 16;
+    int mixer       = c.regs[7];
+    int envshape    = c.regs[13];
+    int noise_count = 1;
 
-            // Конец цикла для CONT, если CONT=0, то остановка счетчика
-            if ((envshape & AY_ENV_CONT) == 0) {
-                ay_env_counter = 0;
-            }
-            else {
+    // Задание уровней звука для тонов
+    int levels[3];
 
-                // Опция HOLD=1
-                if (envshape & AY_ENV_HOLD) {
+    // Огибающая
+    int env_level = ay_tone_levels[ c.env_counter ];
 
-                    // Пилообразная фигура
-                    if (ay_env_first && (envshape & AY_ENV_ALT))
-                        ay_env_counter = (ay_env_counter ? 0 : 15);
-                }
-                // Опция HOLD=0
-                else {
+    // Генерация начальных значений громкости
+    for (int n = 0; n < 3; n++) {
 
-                    if (envshape & AY_ENV_ALT)
-                         ay_env_rev     = !ay_env_rev;
-                    else ay_env_counter = (envshape & AY_ENV_ATTACK) ? 0 : 15;
-                }
-            }
+        int g = c.regs[8 + n];
 
-            ay_env_first = 0;
-        }
+        // Если 4-м бите громкости тона стоит единица, то взять громкость огибающей
+        levels[n] = ay_tone_levels[(g & 16 ? c.env_counter : g) & 15];
+    }
+
+    // Обработчик "огибающей" (envelope)
+    c.env_tick++;
+    while (c.env_tick >= c.env_period) {
+
+        c.env_tick -= c.env_period;
+        ay_env_step(c, envshape);
 
         // Выход, если период нулевой
-        if (!ay_env_period)
+        if (!c.env_period)
             break;
     }
 
@@ -150,113 +219,518 @@ void Z80Spectrum::ay_tick() {
 
         // При деактивированном тоне тут будет либо огибающая,
         // либо уровень, указанный в регистре тона
-        ay_amp[_tone] = level;
+        c.amp[_tone] = level;
 
         // Тон активирован
         if ((mixer & (1 << _tone)) == 0) {
 
             // Счетчик следующей частоты
-            ay_tone_tick[_tone] += 2;
+            c.tone_tick[_tone] += 2;
 
             // Переброска состояния 0->1,1->0
-            if (ay_tone_tick[_tone] >= ay_tone_period[_tone]) {
-                ay_tone_tick[_tone] %= ay_tone_period[_tone];
-                ay_tone_high[_tone] = !ay_tone_high[_tone];
+            if (c.tone_tick[_tone] >= c.tone_period[_tone]) {
+                c.tone_tick[_tone] %= c.tone_period[_tone];
+                c.tone_high[_tone] = !c.tone_high[_tone];
             }
 
             // Генерация меандра
-            ay_amp[_tone] = ay_tone_high[_tone] ? level : 0;
+            c.amp[_tone] = c.tone_high[_tone] ? level : 0;
         }
 
         // Включен шум на этом канале. Он работает по принципу
         // что если включен тон, и есть шум, то он притягивает к нулю
-        if ((mixer & (8 << (_tone))) == 0 && ay_noise_toggle)
-            ay_amp[_tone] = 0;
+        if ((mixer & (8 << (_tone))) == 0 && c.noise_toggle)
+            c.amp[_tone] = 0;
     }
 
     // Обновление noise-фильтра
-    ay_noise_tick += noise_count;
+    c.noise_tick += noise_count;
 
     // Использовать генератор шума пока не будет достигнут нужный период
-    while (ay_noise_tick >= ay_noise_period) {
+    while (c.noise_tick >= c.noise_period) {
 
         // Если тут 0, то все равно учитывать, чтобы не пропускать шум
-        ay_noise_tick -= ay_noise_period;
+        c.noise_tick -= c.noise_period;
 
         // Это псевдогенератор случайных чисел на регистре 17 бит
         // Бит 0: выход; вход: биты 0 xor 3.
-        if ((ay_rng & 1) ^ ((ay_rng & 2) ? 1 : 0))
-            ay_noise_toggle = !ay_noise_toggle;
+        if ((c.rng & 1) ^ ((c.rng & 2) ? 1 : 0))
+            c.noise_toggle = !c.noise_toggle;
 
         // Обновление значения
-        if (ay_rng & 1) ay_rng ^= 0x24000; /* и сдвиг */ ay_rng >>= 1;
+        if (c.rng & 1) c.rng ^= 0x24000;
+        c.rng >>= 1;    // и сдвиг
 
         // Если период нулевой, то этот цикл не закончится
-        if (!ay_noise_period) break;
+        if (!c.noise_period) break;
+    }
+}
+
+// -----------------------------------------------------------------
+// Синтез по событиям: AY просчитывается только к моменту семпла
+// -----------------------------------------------------------------
+
+// Шаг генератора шума в расширенном состоянии: биты 0..16 - регистр,
+// бит 17 - c.noise_toggle. Шаг линеен над GF(2), поэтому прыжок на
+// n шагов - это произведение заранее возведенных в 2^i матриц.
+static unsigned int ay_rng_jump[31][18];
+static int          ay_rng_ready = 0;
+
+static unsigned int ay_rng_step(unsigned int v) {
+
+    unsigned int rng = v & 0x1ffff;
+    unsigned int tg  = (v >> 17) ^ (rng & 1) ^ ((rng >> 1) & 1);
+
+    if (rng & 1) rng ^= 0x24000;
+    rng >>= 1;
+
+    return rng | ((tg & 1) << 17);
+}
+
+static unsigned int ay_rng_apply(const unsigned int* m, unsigned int v) {
+
+    unsigned int r = 0;
+    for (int j = 0; v; j++, v >>= 1)
+        if (v & 1) r ^= m[j];
+
+    return r;
+}
+
+void Z80Spectrum::ay_init_tables() {
+
+    if (ay_rng_ready) return;
+
+    for (int j = 0; j < 18; j++) ay_rng_jump[0][j] = ay_rng_step(1 << j);
+
+    for (int b = 1; b < 31; b++)
+    for (int j = 0; j < 18; j++)
+        ay_rng_jump[b][j] = ay_rng_apply(ay_rng_jump[b-1], ay_rng_jump[b-1][j]);
+
+    ay_rng_ready = 1;
+}
+
+// n шагов генератора шума
+void Z80Spectrum::ay_noise_steps(AYChip& c, int n) {
+
+    unsigned int v = c.rng | (c.noise_toggle ? (1 << 17) : 0);
+
+    if (n < 32) {
+        while (n-- > 0) v = ay_rng_step(v);
+    } else {
+        for (int b = 0; n; b++, n >>= 1)
+            if (n & 1) v = ay_rng_apply(ay_rng_jump[b], v);
+    }
+
+    c.rng          = v & 0x1ffff;
+    c.noise_toggle = (v >> 17) & 1;
+}
+
+// n шагов огибающей: после первого цикла форма периодична (16 или 32 шага)
+// либо застыла, поэтому длинный отрезок стоит не больше 48 шагов
+void Z80Spectrum::ay_env_steps(AYChip& c, int n) {
+
+    int envshape = c.regs[13];
+
+    while (n > 0 && c.env_first) { ay_env_step(c, envshape); n--; }
+
+    if ((envshape & AY_ENV_CONT) && !(envshape & AY_ENV_HOLD)) {
+
+        n %= 32;
+        while (n-- > 0) ay_env_step(c, envshape);
+    }
+    else {
+        c.env_internal_tick = (c.env_internal_tick + n) % 16;
+    }
+}
+
+// Пропустить n тиков без вычисления амплитуд
+void Z80Spectrum::ay_skip(AYChip& c, int n) {
+
+    if (n <= 0) return;
+
+    int mixer = c.regs[7];
+
+    // Огибающая: тот же счетчик, что и в ay_tick, но сразу на n тиков
+    c.env_tick += n;
+    if (c.env_period) {
+        ay_env_steps(c, c.env_tick / c.env_period);
+        c.env_tick %= c.env_period;
+    } else {
+        ay_env_steps(c, n);
+    }
+
+    // Тоны считают только когда включены в микшере
+    for (int _tone = 0; _tone < 3; _tone++) {
+
+        if (mixer & (1 << _tone)) continue;
+
+        int period = c.tone_period[_tone];
+
+        // Первый тик как в ay_tick (счетчик мог остаться больше периода)
+        c.tone_tick[_tone] += 2;
+        if (c.tone_tick[_tone] >= period) {
+            c.tone_tick[_tone] %= period;
+            c.tone_high[_tone] = !c.tone_high[_tone];
+        }
+
+        // Остальные n-1 тиков: сложение по модулю периода
+        if (period == 1) {
+            c.tone_high[_tone] ^= (n - 1) & 1;
+        } else {
+
+            int total = c.tone_tick[_tone] + 2*(n - 1);
+
+            c.tone_high[_tone] ^= (total / period) & 1;
+            c.tone_tick[_tone]  =  total % period;
+        }
+    }
+
+    // Шум
+    c.noise_tick += n;
+    if (c.noise_period) {
+        ay_noise_steps(c, c.noise_tick / c.noise_period);
+        c.noise_tick %= c.noise_period;
+    } else {
+        ay_noise_steps(c, n);
+    }
+}
+
+// Через сколько тиков выход AY может измениться (1 - на ближайшем).
+// Шум и огибающая меняют уровни тиком позже своего шага: ay_tick
+// берет их значения до обновления.
+int Z80Spectrum::ay_next_change(AYChip& c) {
+
+    if (c.dirty) return 1;
+
+    int mixer = c.regs[7];
+    int next  = 1 << 30;
+    int noise = 0, env = 0;
+
+    for (int _tone = 0; _tone < 3; _tone++) {
+
+        int g = c.regs[8 + _tone];
+
+        if (g & 16) env = 1;
+        else if ((g & 15) == 0) continue; // Канал молчит
+
+        if ((mixer & (8 << _tone)) == 0) noise = 1;
+
+        // Переброска меандра на первом тике, где tick + 2m >= period
+        if ((mixer & (1 << _tone)) == 0) {
+
+            int tick   = c.tone_tick[_tone];
+            int period = c.tone_period[_tone];
+            int m      = (tick + 2 >= period) ? 1 : (period - tick + 1) / 2;
+
+            if (m < next) next = m;
+        }
+    }
+
+    if (noise) {
+
+        int m = c.noise_period > c.noise_tick ? c.noise_period - c.noise_tick : 1;
+        if (m + 1 < next) next = m + 1;
     }
+
+    // Огибающая, застывшая после первого цикла, уровень не меняет
+    int envshape = c.regs[13];
+    if (env && (c.env_first || ((envshape & AY_ENV_CONT) && !(envshape & AY_ENV_HOLD)))) {
+
+        int m = c.env_period > c.env_tick ? c.env_period - c.env_tick : 1;
+        if (m + 1 < next) next = m + 1;
+    }
+
+    return next;
 }
 
-// Добавить уровень
-void Z80Spectrum::ay_amp_adder(int& left, int& right) {
+// Раскладка каналов по стерео (-P), веса в 1/256
+void Z80Spectrum::ay_pan_init(int layout) {
 
-    // Каналы A-слева; B-посередине; C-справа
-    left  += (ay_amp[0] + (ay_amp[1]/2)) / 4;
-    right += (ay_amp[2] + (ay_amp[1]/2)) / 4;
+    //                      A         B         C
+    static const int abc[3][2] = { {256, 0}, {128, 128}, {0, 256} };
+    static const int acb[3][2] = { {256, 0}, {0, 256}, {128, 128} };
 
-    // Потому что уши режет такой звук, сделал моно
-    int center = (left + right) / 2;
+    for (int ch = 0; ch < 6; ch++)
+    for (int lr = 0; lr < 2; lr++) {
 
-    if (ay_mono) {
-        left  = center;
-        right = center;
+        switch (layout) {
+            case AY_LAYOUT_ACB:  ay_pan[ch][lr] = acb[ch % 3][lr]; break;
+            case AY_LAYOUT_MONO: ay_pan[ch][lr] = 128; break;
+            default:             ay_pan[ch][lr] = abc[ch % 3][lr]; break;
+        }
+    }
+}
+
+// Новые амплитуды AY на такте t -> перепад в выходной буфер. Каналы
+// сводятся только здесь, на изменении уровня, а не на каждом семпле
+void Z80Spectrum::ay_emit(int t) {
+
+    int left = 0, right = 0;
+
+    for (int ch = 0; ch < 3*ay_chips; ch++) {
+
+        int a  = ay[ch / 3].amp[ch % 3];
+        left  += a * ay_pan[ch][0];
+        right += a * ay_pan[ch][1];
     }
 
-    if (left  > 255) left  = 255; else if (left  < 0) left  = 0;
-    if (right > 255) right = 255; else if (right < 0) right = 0;
+    left  = (left  >> 8) * AY_SCALE;
+    right = (right >> 8) * AY_SCALE;
+
+    if (left != ay_out[0] || right != ay_out[1]) {
+
+        blip_add(t, left - ay_out[0], right - ay_out[1]);
+        ay_out[0] = left;
+        ay_out[1] = right;
+    }
 }
 
-int p_beep; // прошлое значение 
-int vol; //громкость бипера
-int ofs = 8;
-// Вызывается каждую 1/44100 секунду
-void Z80Spectrum::ay_sound_tick(int t_states, int& audio_c) {
-
-    // Гарантированное 44100
-    t_states_wav += 44100 * t_states;
-
-    // К следующему звуковому тику
-    if (t_states_wav > max_audio_cycle) {
-
-        // Для аккуратного перекидывания остатков
-        t_states_wav -= max_audio_cycle;
-
-        // Порт бипера берется за основу тона
-        //int beep  = !!(port_fe & 0x10) ^ !!(port_fe & 0x08);        
-        int beep = (port_fe & 0x18) >> 3;      
-        
-        if (beep != p_beep) {             
-            p_beep = beep;
-            if (beep) vol = beep*(ofs=-1*ofs); 
-            else vol = 0;     
+// n тиков чипа: последний с расчетом амплитуд (tick=1) или без
+void Z80Spectrum::ay_steps(AYChip& c, int n, int tick) {
+
+    ay_skip(c, n - 1);
+
+    int noise = c.noise_toggle;
+    int env   = c.env_counter;
+
+    if (tick) ay_tick(c); else ay_skip(c, 1);
+
+    // Шаг шума или огибающей слышен со следующего тика
+    c.dirty = (noise != c.noise_toggle || env != c.env_counter);
+}
+
+// Просчитать AY до такта t кадра (тики идут на тактах, кратных 32).
+// Тики, на которых выход не меняется ни у одного чипа, пропускаются.
+void Z80Spectrum::ay_advance(int t) {
+
+    int j   = (ay_t_pos + 31) >> 5;
+    int end = (t + 31) >> 5;
+
+    // Эталон для сверки: ay_tick и вывод на каждом тике
+    if (ay_reference) {
+
+        for (; j < end; j++) {
+
+            for (int _c = 0; _c < ay_chips; _c++) ay_tick(ay[_c]);
+            ay_emit(j << 5);
         }
-        int left  = 0x80 + vol; 
-        int right = 0x80 + vol;
-        //int left  = 0x80 + (beep ? 0 : 32);
-        //int right = 0x80 + (beep ? 0: 32); 
 
-        // Использовать AY
-        ay_amp_adder(left, right);
+        ay_t_pos = t;
+        return;
+    }
+
+    while (j < end) {
+
+        int k = ay_next_change(ay[0]);
+
+        if (ay_chips > 1) {
+
+            int k2 = ay_next_change(ay[1]);
+            if (k2 < k) k = k2;
+        }
+
+        // Последний тик: с выводом, либо пропуск до конца отрезка
+        int n = k > end - j ? end - j : k;
+
+        for (int _c = 0; _c < ay_chips; _c++) ay_steps(ay[_c], n, n == k);
+        j += n;
+
+        if (n == k) ay_emit((j - 1) << 5);
+    }
+
+    ay_t_pos = t;
+}
+
+// Применить накопленные записи по их тактам и просчитать AY до такта t
+void Z80Spectrum::ay_sync(int t) {
+
+    for (int _i = 0; _i < ay_event_count; _i++) {
+
+        AYEvent& ev = ay_events[_i];
+
+        ay_advance(ev.t);
+        ay_apply(ay[ev.reg >> 4], ev.reg & 15, ev.data);
+    }
+
+    ay_event_count = 0;
+    ay_advance(t);
+}
+
+// -----------------------------------------------------------------
+// Band-limited вывод
+// -----------------------------------------------------------------
+
+// Перепады уровня (бипер, AY) складываются в буфер как импульсы с
+// ограниченной полосой; интеграл по буферу дает ступеньку без наложения
+// спектров. Стоимость - BLIP_WIDTH сложений на перепад, не на семпл.
+static int blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+static int blip_ready = 0;
+
+// Ядро: sinc со срезом 0.9 Найквиста, окно Блэкмана. Каждая фаза
+// нормирована к 1 << BLIP_BITS, чтобы интеграл не уходил по постоянке.
+void Z80Spectrum::blip_init() {
+
+    blip_frame_len = (long long) audio_rate * BLIP_PHASES / 50;
+    blip_pos       = 0;
+    blip_base      = 0;
+    blip_acc[0]    = blip_acc[1] = 0;
+    ay_out[0]      = ay_out[1]   = 0;
+    dc_x[0] = dc_x[1] = dc_y[0] = dc_y[1] = 0;
+    dc_r           = 1.0f - 2 * (float) M_PI * 10 / audio_rate;   // Срез 10 Гц
+    memset(blip_buf, 0, sizeof(blip_buf));
 
-        // Запись во временный буфер
-        audio_frame[audio_c++] = left;
-        audio_frame[audio_c++] = right;
+    if (blip_ready) return;
+
+    for (int p = 0; p < BLIP_PHASES; p++) {
+
+        double h[BLIP_WIDTH], sum = 0;
+
+        for (int k = 0; k < BLIP_WIDTH; k++) {
+
+            double x = k - (BLIP_WIDTH/2 - 1) - (double) p / BLIP_PHASES;
+            double a = M_PI * 0.9 * x;
+            double w = M_PI * x / (BLIP_WIDTH/2);
+
+            h[k] = (x == 0 ? 1.0 : sin(a) / a) * (0.42 + 0.5*cos(w) + 0.08*cos(2*w));
+            sum += h[k];
+        }
+
+        int total = 0;
+        for (int k = 0; k < BLIP_WIDTH; k++) {
+
+            blip_kernel[p][k] = (int) lround(h[k] / sum * (1 << BLIP_BITS));
+            total += blip_kernel[p][k];
+        }
+
+        // Ошибка округления - в центральный отсчет
+        blip_kernel[p][BLIP_WIDTH/2 - 1] += (1 << BLIP_BITS) - total;
+    }
+
+    blip_ready = 1;
+}
+
+// Перепад уровня на такте t текущего кадра
+void Z80Spectrum::blip_add(int t, int dl, int dr) {
+
+    long long  p = blip_pos + (long long) t * blip_frame_len / BLIP_FRAME;
+    int        i = (int)(p / BLIP_PHASES - blip_base);
+    const int* k = blip_kernel[p % BLIP_PHASES];
+
+    int* l = blip_buf[0] + i;
+    int* r = blip_buf[1] + i;
+
+    for (int w = 0; w < BLIP_WIDTH; w++) {
+        l[w] += dl * k[w];
+        r[w] += dr * k[w];
+    }
+}
+
+// Бипер: запись в порт FE, меняющая EAR/MIC, - в список перепадов кадра
+// с тактом инструкции. Список разбирает звук в конце кадра
+void Z80Spectrum::beep_edge(int bits) {
+
+    if (aev_file) aev_put(AEV_BEEP, bits, t_states_cycle);
+
+    // Больше одной записи на инструкцию не бывает; переполнение -
+    // только вне кадра (пошаговая отладка)
+    if (beep_edge_count == BEEP_EDGES) return;
+
+    BeepEdge& e = beep_edges[beep_edge_count++];
+
+    e.t     = t_states_cycle;
+    e.bits  = bits;
+    e.clock = cpu_clock;
+}
+
+// Перепады кадра - ступеньки в band-limited буфер и перепады MIC - на
+// запись ленты; список очищается
+void Z80Spectrum::beep_frame() {
+
+    if (save_file) mic_take();
+
+    for (int _i = 0; _i < beep_edge_count; _i++) {
+
+        BeepEdge& e = beep_edges[_i];
+
+        int level_new = (e.bits     & 0x10 ? BEEP_EAR : 0) + (e.bits     & 0x08 ? BEEP_MIC : 0);
+        int level_old = (beep_level & 0x10 ? BEEP_EAR : 0) + (beep_level & 0x08 ? BEEP_MIC : 0);
+
+        if (ay_synth) blip_add(e.t, level_new - level_old, level_new - level_old);
+        beep_level = e.bits;
+    }
+
+    beep_edge_count = 0;
+    mic_seen        = 0;
+}
+
+// Громкость и мягкое ограничение выше AUDIO_KNEE, перевод в 16 бит.
+// Без зависимостей между семплами: цикл векторизуется компилятором
+static void audio_shape(const float* __restrict in, short* __restrict out, int n, float gain) {
+
+    const float k = AUDIO_KNEE, r = 1.0f - AUDIO_KNEE;
+
+    for (int _i = 0; _i < n; _i++) {
+
+        float x    = in[_i] * gain;
+        float a    = fabsf(x);
+        float over = 0.5f * (a - k + fabsf(a - k));    // max(a - k, 0) без ветвлений
+        float y    = a - over + r * over / (r + over);
+
+        out[_i] = (short) (copysignf(y, x) * 32767.0f);
+    }
+}
+
+// Конец кадра: проинтегрировать буфер в семплы (audio_pcm, стерео,
+// 16 бит). Возвращает число стереосемплов
+int Z80Spectrum::audio_end_frame() {
+
+    long long end = blip_pos + blip_frame_len;
+    int       n   = (int)(end / BLIP_PHASES - blip_base);
+
+    for (int ch = 0; ch < 2; ch++) {
+
+        int   acc = blip_acc[ch];
+        float x1  = dc_x[ch], y1 = dc_y[ch];
+
+        // Интеграл и срез постоянной составляющей - рекурсия, по семплу
+        for (int _i = 0; _i < n; _i++) {
+
+            acc += blip_buf[ch][_i];
+
+            float x = acc * (1.0f / (32768 << BLIP_BITS));
+            y1 = x - x1 + dc_r * y1;
+            x1 = x;
+
+            audio_mix[ch][_i] = y1;
+        }
+
+        blip_acc[ch] = acc;
+        dc_x[ch]     = x1;
+        dc_y[ch]     = y1;
+
+        audio_shape(audio_mix[ch], audio_chan[ch], n, audio_gain);
+    }
+
+    for (int _i = 0; _i < n; _i++) {
+
+        audio_pcm[2*_i]     = audio_chan[0][_i];
+        audio_pcm[2*_i + 1] = audio_chan[1][_i];
+    }
 
 #ifndef NO_SDL
-        // Запись аудиострима в буфер (с циклом)
-        AudioZXFrame = ab_cursor / (2*882);
-        ZXAudioBuffer[ab_cursor++] = left;
-        ZXAudioBuffer[ab_cursor++] = right;
-        ab_cursor %= MAX_AUDIOSDL_BUFFER;
+    // При загрузке с ленты кадры идут быстрее звуковой карты: только в файл
+    if (audio_dev && !tape_turbo) audio_push(audio_pcm, n);
 #endif
+
+    // Хвосты ядер последних перепадов переходят в следующий кадр
+    for (int ch = 0; ch < 2; ch++) {
+
+        memmove(blip_buf[ch], blip_buf[ch] + n, BLIP_WIDTH * sizeof(int));
+        memset (blip_buf[ch] + BLIP_WIDTH, 0, n * sizeof(int));
     }
+
+    blip_base += n;
+    blip_pos   = end;
+
+    return n;
 }
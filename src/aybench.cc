@@ -0,0 +1,365 @@
+// -----------------------------------------------------------------
+// Стенд синтеза звука
+// -----------------------------------------------------------------
+
+// Журналы звуковых событий (vmzx -e) проигрываются через ay_write_data,
+// beep_edge, ay_sync и audio_end_frame без эмуляции Z80. На выходе -
+// скорость синтеза и хеш PCM (FNV-1a); с -c хеши сверяются с эталоном.
+//
+//   aybench [-R частота] [-n повторов] журнал.aev ... > эталон.txt
+//   aybench -c aylog/golden.txt
+//   aybench -x [-r потоков] [-R частота] [журнал.aev ... | -c aylog/golden.txt]
+//
+// Строка эталона: хеш, семплов, частота, журнал (путь от файла эталона).
+// Хеш зависит от флагов сборки (float в DC-фильтре и ограничителе):
+// эталон снят со сборкой из makefile.
+//
+// С -x каждый журнал и еще несколько случайных потоков записей в регистры
+// проигрываются дважды: синтезом по событиям и эталонным ay_tick на
+// каждом тике (ay_reference). PCM должен совпасть до семпла.
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#define main vmzx_main
+#include "main.cc"
+#undef main
+
+// Случайный поток для -x: кадров в потоке, длина кадра в тактах
+#define BENCH_RANDOM_FRAMES 100
+#define BENCH_FRAME         71680
+
+class AYBench final : public Z80Spectrum {
+public:
+
+    // Z80 не эмулируется: ПЗУ не нужны
+    AYBench() : Z80Spectrum(0) { }
+
+    unsigned long long hash;
+    long long          samples;
+    int                keep = 0;    // Сохранять PCM в pcm
+    std::vector<short> pcm;
+
+    void replay(const unsigned char* log, int size, int rate);
+    int  cross(const unsigned char* log, int size, int rate, const char* name);
+};
+
+// Один проход по журналу с исходного состояния
+void AYBench::replay(const unsigned char* log, int size, int rate) {
+
+    audio_rate = rate;
+    ay_synth   = 1;
+
+    ay_reset();
+    blip_init();
+
+    hash    = 0xcbf29ce484222325ULL;
+    samples = 0;
+    pcm.clear();
+
+    for (int _i = AEV_HEADER; _i + AEV_RECORD <= size; _i += AEV_RECORD) {
+
+        const unsigned char* p = log + _i;
+
+        int code = p[0], data = p[1];
+        int t    = p[2] | (p[3] << 8) | (p[4] << 16);
+
+        if (code == AEV_FRAME) {
+
+            beep_frame();
+            ay_sync(t);
+            int n = audio_end_frame();
+            ay_t_pos = 0;
+
+            for (int _s = 0; _s < 2*n; _s++) {
+
+                hash = (hash ^ (audio_pcm[_s] & 255))        * 0x100000001b3ULL;
+                hash = (hash ^ ((audio_pcm[_s] >> 8) & 255)) * 0x100000001b3ULL;
+            }
+
+            samples += n;
+            if (keep) pcm.insert(pcm.end(), audio_pcm, audio_pcm + 2*n);
+        }
+        else if (code == AEV_BEEP) {
+
+            t_states_cycle = t;
+            beep_edge(data);
+        }
+        else {
+
+            t_states_cycle = t;
+            ay_sel         = code >> 4;
+            ay_register    = code & 15;
+            if (ay_sel) ay_chips = 2;
+
+            ay_write_data(data);
+        }
+    }
+}
+
+// Журнал целиком в память
+static unsigned char* bench_load(const char* filename, int* size) {
+
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) { fprintf(stderr, "Can't open file %s\n", filename); return NULL; }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char* log = (unsigned char*) malloc(*size);
+    int got = fread(log, 1, *size, fp);
+    fclose(fp);
+
+    if (got != *size || *size < AEV_HEADER || memcmp(log, "AEV\x1A", 4) != 0) {
+
+        fprintf(stderr, "%s: not an audio event log\n", filename);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+// Проиграть журнал repeat раз; время - лучший проход, секунды
+static double bench_run(AYBench* vm, const char* filename, int rate, int repeat) {
+
+    int size;
+    unsigned char* log = bench_load(filename, &size);
+    if (log == NULL) return -1;
+
+    double best = 0;
+
+    for (int _r = 0; _r < repeat; _r++) {
+
+        auto start = std::chrono::steady_clock::now();
+        vm->replay(log, size, rate);
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (_r == 0 || sec < best) best = sec;
+    }
+
+    free(log);
+
+    fprintf(stderr, "%-32s %8lld samples  %7.2f Msamples/s  x%.0f realtime\n",
+            filename, vm->samples, vm->samples / best / 1e6, vm->samples / best / rate);
+
+    return best;
+}
+
+// Журнал по событиям и эталонным ay_tick; 1 - PCM разошелся
+int AYBench::cross(const unsigned char* log, int size, int rate, const char* name) {
+
+    std::vector<short> fast;
+
+    keep = 1;
+
+    ay_reference = 0;
+    replay(log, size, rate);
+    fast.swap(pcm);
+
+    ay_reference = 1;
+    replay(log, size, rate);
+
+    ay_reference = 0;
+    keep         = 0;
+
+    std::vector<short>& ref = pcm;
+
+    if (fast.size() != ref.size()) {
+
+        fprintf(stderr, "FAIL %s @ %d: %zu samples, reference %zu\n", name, rate, fast.size() / 2, ref.size() / 2);
+        return 1;
+    }
+
+    for (size_t _i = 0; _i < ref.size(); _i++) {
+
+        if (fast[_i] != ref[_i]) {
+
+            fprintf(stderr, "FAIL %s @ %d: sample %zu (%s) is %d, reference %d\n",
+                    name, rate, _i / 2, _i & 1 ? "R" : "L", fast[_i], ref[_i]);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "%-32s %8zu samples match reference\n", name, ref.size() / 2);
+    return 0;
+}
+
+// Случайные записи во все регистры обоих чипов: короткие периоды тона,
+// шума и огибающей, где пропуски тиков ошибаются легче всего
+static unsigned char* bench_random(unsigned int seed, int* size) {
+
+    std::vector<unsigned char> log = { 'A', 'E', 'V', 0x1A, 1, 0, 0, 0 };
+
+    auto rnd = [&seed](int n) { seed = seed * 1103515245 + 12345; return (int)((seed >> 8) % n); };
+
+    auto put = [&log](int code, int data, int t) {
+        unsigned char r[AEV_RECORD] = { (unsigned char) code, (unsigned char) data,
+                                        (unsigned char) t, (unsigned char)(t >> 8), (unsigned char)(t >> 16) };
+        log.insert(log.end(), r, r + AEV_RECORD);
+    };
+
+    for (int _f = 0; _f < BENCH_RANDOM_FRAMES; _f++) {
+
+        int count = rnd(12), times[12];
+
+        for (int _i = 0; _i < count; _i++) times[_i] = rnd(BENCH_FRAME);
+        std::sort(times, times + count);
+
+        for (int _i = 0; _i < count; _i++) {
+
+            int chip = rnd(4) == 0, reg = rnd(14), data;
+
+            switch (reg) {
+
+                case 1: case 3: case 5: case 12:
+                         data = rnd(4) ? 0 : rnd(256); break;  // Старшие байты - чаще короткий период
+                case 6:  data = rnd(32); break;
+                case 7:  data = rnd(64); break;
+                case 8: case 9: case 10:
+                         data = rnd(3) ? rnd(16) : 16; break;  // Громкость или огибающая
+                case 11: data = rnd(8); break;
+                case 13: data = rnd(16); break;
+                default: data = rnd(4) ? rnd(8) : rnd(256); break;
+            }
+
+            put((chip << 4) | reg, data, times[_i]);
+        }
+
+        put(AEV_FRAME, 0, BENCH_FRAME);
+    }
+
+    *size = (int) log.size();
+
+    unsigned char* p = (unsigned char*) malloc(log.size());
+    memcpy(p, log.data(), log.size());
+
+    return p;
+}
+
+// Сверка с эталоном: код выхода - число расхождений. С cross вместо
+// хешей - сверка синтеза по событиям с ay_reference
+static int bench_check(AYBench* vm, const char* golden, int repeat, int cross) {
+
+    FILE* fp = fopen(golden, "r");
+    if (fp == NULL) { fprintf(stderr, "Can't open file %s\n", golden); return 1; }
+
+    // Журналы лежат рядом с эталоном
+    char dir[256] = "", path[512], line[512], name[256];
+    const char* slash = strrchr(golden, '/');
+    if (slash) snprintf(dir, sizeof(dir), "%.*s", (int)(slash - golden + 1), golden);
+
+    int failed = 0, total = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+
+        unsigned long long hash;
+        long long samples;
+        int rate;
+
+        if (line[0] == '#' || sscanf(line, "%llx %lld %d %255s", &hash, &samples, &rate, name) != 4) continue;
+
+        snprintf(path, sizeof(path), "%s%s", dir, name);
+        total++;
+
+        if (cross) {
+
+            int size;
+            unsigned char* log = bench_load(path, &size);
+
+            if (log == NULL || vm->cross(log, size, rate, name)) failed++;
+            free(log);
+            continue;
+        }
+
+        if (bench_run(vm, path, rate, repeat) < 0 || vm->hash != hash || vm->samples != samples) {
+
+            fprintf(stderr, "FAIL %s @ %d: %016llx %lld, expected %016llx %lld\n",
+                    name, rate, vm->hash, vm->samples, hash, samples);
+            failed++;
+        }
+    }
+
+    fclose(fp);
+    fprintf(stderr, "%d of %d logs match\n", total - failed, total);
+
+    return failed;
+}
+
+int main(int argc, char** argv) {
+
+    // Деструктор Z80Spectrum не виртуальный: удаляется именно AYBench
+    std::unique_ptr<AYBench> bench(new AYBench);
+    AYBench* vm = bench.get();
+
+    const char* golden = NULL;
+    int rate = 44100, repeat = 1, failed = 0, cross = 0, streams = 16;
+
+    for (int u = 1; u < argc; u++) {
+
+        if      (strcmp(argv[u], "-c") == 0 && u + 1 < argc) golden  = argv[++u];
+        else if (strcmp(argv[u], "-R") == 0 && u + 1 < argc) rate    = atoi(argv[++u]);
+        else if (strcmp(argv[u], "-n") == 0 && u + 1 < argc) repeat  = atoi(argv[++u]);
+        else if (strcmp(argv[u], "-r") == 0 && u + 1 < argc) streams = atoi(argv[++u]);
+        else if (strcmp(argv[u], "-x") == 0) cross = 1;
+        else if (argv[u][0] == '-') {
+
+            fprintf(stderr, "Usage: aybench [-R rate] [-n repeat] log.aev ... | aybench [-n repeat] -c golden.txt\n"
+                            "       aybench -x [-r streams] [-R rate] [log.aev ... | -c golden.txt]\n");
+            return 1;
+        }
+    }
+
+    if (rate < 8000 || rate > AUDIO_RATE_MAX) { fprintf(stderr, "Rate out of range\n"); return 1; }
+    if (repeat < 1) repeat = 1;
+
+    if (cross) {
+
+        // Журналы: из эталона (каждый на своей частоте) или из аргументов
+        if (golden) failed = bench_check(vm, golden, 1, 1);
+
+        for (int u = 1; u < argc && !golden; u++) {
+
+            if (argv[u][0] == '-') { if (argv[u][1] != 'x') u++; continue; }
+
+            int size;
+            unsigned char* log = bench_load(argv[u], &size);
+
+            if (log == NULL || vm->cross(log, size, rate, argv[u])) failed++;
+            free(log);
+        }
+
+        // Случайные потоки; на второй половине - частота 96000
+        for (int _s = 0; _s < streams; _s++) {
+
+            int  size;
+            char name[32];
+            unsigned char* log = bench_random(_s + 1, &size);
+
+            snprintf(name, sizeof(name), "random #%d", _s + 1);
+            if (vm->cross(log, size, 2*_s < streams ? rate : 96000, name)) failed++;
+            free(log);
+        }
+
+        fprintf(stderr, failed ? "%d cross-checks failed\n" : "event-driven AY matches reference\n", failed);
+    }
+    else if (golden) {
+        failed = bench_check(vm, golden, repeat, 0);
+    }
+    else {
+
+        // Строки эталона в stdout
+        for (int u = 1; u < argc; u++) {
+
+            if (argv[u][0] == '-') { u++; continue; }
+            if (bench_run(vm, argv[u], rate, repeat) < 0) { failed++; continue; }
+
+            const char* name = strrchr(argv[u], '/');
+            printf("%016llx %lld %d %s\n", vm->hash, vm->samples, rate, name ? name + 1 : argv[u]);
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -1,9 +1,17 @@
 
 // Конструктор
-Z80Spectrum::Z80Spectrum() {
+Z80Spectrum::Z80Spectrum(int load_roms) {
 
 #ifndef NO_SDL
-    sdl_screen = NULL;
+    sdl_screen   = NULL;
+    sdl_renderer = NULL;
+    pixels       = NULL;
+    tb_dirty     = 0;
+    tb_state     = 0;
+    tb_event     = (Uint32) -1;
+    emu_running  = 0;
+    ev_head      = 0;
+    ev_tail      = 0;
 #endif
     width               = 320*3;
     height              = 240*3;
@@ -12,16 +20,20 @@ Z80Spectrum::Z80Spectrum() {
     auto_keyb           = 0;
     frame_id            = 0;
     diff_prev_frame     = 1; // Первый кадр всегда отличается
+    frame_render        = 1;
+    screenshot_file     = NULL;
+    snapshot_file       = NULL;
+    shutdown_done       = 0;
 
     t_states_cycle      = 0;
     t_states_all        = 0;
+    cpu_clock           = 0;
     flash_state         = 0;
     flash_counter       = 0;
     //ms_clock_old        = 0;
     autostart           = 0;
     frame_counter       = 0;
     skip_dup_frame      = 0;
-    max_audio_cycle     = 0;
     sdl_disable_sound   = 0;
     klatch              = 0;
     kshift              = 0;
@@ -31,24 +43,92 @@ Z80Spectrum::Z80Spectrum() {
     port_fe             = 0;
     skip_first_frames   = 0;
     trdos_latch         = 0;
+    start_tape          = 0;
+    tapfile             = NULL;
+    tapsize             = 0;
+    tape_format         = TAPE_TAP;
+    tape_scan           = 0;
+    tape_blocks         = NULL;
+    tape_block_count    = 0;
+    tape_block_max      = 0;
+    tape_segs           = NULL;
+    tape_seg_count      = 0;
+    tape_seg_max        = 0;
+    tape_chunk_block    = 0;
+    tape_chunk_first    = 1;
+    tape_chunk_lead     = 0;
+    tape_chunk_level    = 0;
+    tape_gen_block      = 0;
+    tape_gen_stage      = 0;
+    tape_gen_pos        = 0;
+    tape_gen_level      = 0;
+    tape_gen_stop       = 0;
+    tape_pend_len       = 0;
+    tape_pend_level     = 0;
+    tape_loop_block     = 0;
+    tape_loop_left      = 0;
+    tape_call_block     = -1;
+    tape_call_pos       = 0;
+    tape_seg            = 0;
+    tape_left           = 0;
+    tape_edge           = TAPE_NEVER;
+    tape_level          = 0;
+    tape_flash          = 0;
+    tape_quiet          = 0;
+    tape_turbo_on       = 1;
+    tape_turbo          = 0;
+    tape_reads          = 0;
+    tape_idle           = 0;
+    save_file           = NULL;
+    save_tzx            = 0;
+    save_blocks         = 0;
+    mic_pulses          = NULL;
+    mic_count           = 0;
+    mic_max             = 0;
+    mic_edges           = 0;
+    mic_level           = 0;
+    mic_last            = 0;
+    mic_seen            = 0;
 
-    wav_cursor          = 0;
-    t_states_wav        = 0;
-    ay_rng              = 1;
-    ab_cursor           = 0;
-    ay_noise_tick       = 0;
-    ay_noise_period     = 0;
-    ay_noise_toggle     = 0;
-    ay_env_first        = 1;
-    ay_env_rev          = 0;
-    ay_env_period       = 0;
-    ay_mono             = 0;
+    wav_float           = 0;
+    wav_mono            = 0;
+    wav_seekable        = 0;
+    wav_header          = 0;
+    wav_bytes           = 0;
+    wav_slot            = NULL;
+    psg_file            = NULL;
+    psg_slot            = NULL;
+    psg_waits           = 0;
+    aev_file            = NULL;
+    aev_slot            = NULL;
+    aev_started         = 0;
+    audio_gain          = 1.0f;
+    ay_synth            = 1;
+    ay_reference        = 0;
+    audio_rate          = 44100;
+    audio_latency       = 40;
+    pace_mode           = 0;
+    pace_freq           = 1;
+    pace_start          = 0;
+    pace_frames         = 0;
 
     // Настройки записи фреймов
     con_frame_start     = 0;
     con_frame_end       = 150;
-    con_frame_fps       = 30;
+    con_frame_fps       = 50;
     record_file         = NULL;
+    video_format        = VIDEO_BMP;
+    record_header       = 0;
+
+    // Очередь записи
+    rec_slots           = 32;
+    rec_policy          = REC_BLOCK;
+    rec_pool            = NULL;
+    rec_running         = 0;
+    rec_frames          = 0;
+    rec_dropped         = 0;
+    rec_stalls          = 0;
+    rec_max_depth       = 0;
     wave_file           = NULL;
 
     // Инициализация Debugger View
@@ -77,10 +157,34 @@ Z80Spectrum::Z80Spectrum() {
     spi_status          = 0;
     spi_lba             = 0;
     spi_file            = NULL;
+    spi_image           = "sd.img";
+    spi_card            = 0;
+    spi_sectors         = 0;
+    spi_tick            = 0;
+    spi_dirty           = 0;
+    spi_frames          = 0;
+
+    for (int _i = 0; _i < SPI_CACHE; _i++) {
+
+        spi_cache[_i].lba   = -1;
+        spi_cache[_i].dirty = 0;
+        spi_cache[_i].used  = 0;
+    }
 
 #ifndef NO_SDL
-    AudioSDLFrame       = 0; // SDL-фрейм позади основного
-    AudioZXFrame        = 8; // Генеральный фрейм
+    audio_dev           = 0;
+    audio_sem           = NULL;
+    audio_wr            = 0;
+    audio_rd            = 0;
+    audio_limit         = AUDIO_RING;
+    audio_target        = 0;
+    audio_started       = 0;
+    drc_fill            = 0;
+    drc_integ           = 0;
+    audio_latency_us    = 0;
+    audio_corr_ppm      = 0;
+    audio_underruns     = 0;
+    audio_overruns      = 0;
 #endif
 
     // Заполнение таблицы адресов
@@ -88,23 +192,34 @@ Z80Spectrum::Z80Spectrum() {
         lookupfb[y] = 0x4000 + 32*((y & 0x38)>>3) + 256*(y&7) + 2048*(y>>6);
     }
 
-    // Обязательные ROM
-    loadrom("48k.rom",   1);
-    loadrom("128k.rom",  0);
-    loadrom("trdos.rom", 4);
+    // Обязательные ROM; утилитам без эмуляции (snaptool) не нужны
+    if (load_roms) {
+
+        loadrom("48k.rom",   1);
+        loadrom("128k.rom",  0);
+        loadrom("trdos.rom", 4);
+    }
 
     // Коррекция уровня
     for (int _f = 0; _f < 16; _f++) {
         ay_tone_levels[_f] = (ay_levels[_f]*256 + 0x8000) / 0xffff;
     }
 
-    for (int _f = 0; _f < 3; _f++) {
-        ay_tone_high[_f]   = 0;
-        ay_tone_tick[_f]   = 0;
-        ay_tone_period[_f] = 1;
-    }
+    ay_reset();
+    ay_pan_init(AY_LAYOUT_ABC);
+    ay_init_tables();
+    blip_init();
+
+    // Палитра для Y4M: Y 16..235, Cb/Cr 16..240
+    for (int _f = 0; _f < 16; _f++) {
 
-    ay_regs[7] = 0xff;
+        Uint32 cl = get_color(_f);
+        int r = (cl >> 16) & 255, g = (cl >> 8) & 255, b = cl & 255;
+
+        pal_yuv[_f][0] = ( 66*r + 129*g +  25*b + 128) / 256 + 16;
+        pal_yuv[_f][1] = (-38*r -  74*g + 112*b + 128) / 256 + 128;
+        pal_yuv[_f][2] = (112*r -  94*g -  18*b + 128) / 256 + 128;
+    }
 
     // Все кнопки вначале отпущены
     for (int _i = 0; _i < 8; _i++) {
@@ -119,14 +234,53 @@ Z80Spectrum::~Z80Spectrum() {
     if (sdl_enable) SDL_Quit();
 #endif
 
+    shutdown();
+    if (vm_instance == this) vm_instance = NULL;
+}
+
+// Дописать и закрыть все файлы записи. Вызывается из деструктора или при
+// exit() (ошибка, HALT с -h) - тогда деструктор не вызывается, а очередь
+// асинхронной записи и заголовок WAV иначе пропадут
+void Z80Spectrum::shutdown() {
+
+    if (shutdown_done) return;
+    shutdown_done = 1;
+
+    // Фоновая запись снапшота (F2) должна закончиться
+    if (snap_thread.joinable()) snap_thread.join();
+
+    // Дописать очередь записи
+    wav_close();
+    if (psg_file) psg_flush();
+    if (aev_file) aev_flush();
+    rec_stop();
+
     // Финализация видеопотока
     if (record_file) {
         fclose(record_file);
     }
 
-    // Финализация WAV
+    if (psg_file && psg_file != stdout) fclose(psg_file);
+    if (aev_file && aev_file != stdout) fclose(aev_file);
+
+    // Финализация WAV: в канал заголовок уже ушел потоковым
     if (wave_file) {
-        //waveFmtHeader();
-        fclose(wave_file);
+
+        if (!wav_header || wav_seekable) waveFmtHeader(wav_seekable);
+        if (wave_file != stdout) fclose(wave_file);
+    }
+
+    if (tapfile) unmap_file(tapfile, tapsize);
+    free(tape_segs);
+    free(tape_blocks);
+
+    if (save_file) save_close();
+    free(mic_pulses);
+
+    // Несброшенные сектора SD-карты - в образ
+    if (spi_file) {
+
+        spi_flush();
+        fclose(spi_file);
     }
 }
@@ -51,9 +51,9 @@ void Z80Spectrum::mem_write(unsigned int address, unsigned char data) {
 // Чтение из порта
 unsigned char Z80Spectrum::io_read(unsigned int port) {
 
-    // Чтение клавиатуры    
-    if      (port == 0xFFFD) { return ay_regs[ay_register%15]; }
-    else if (port == 0xBFFD) { return ay_regs[ay_register%15]; }
+    // Чтение регистров AY (сначала применить отложенные записи)
+    if      (port == 0xFFFD) { if (ay_synth) ay_sync(t_states_cycle); return ay[ay_sel].regs[ay_register%15]; }
+    else if (port == 0xBFFD) { if (ay_synth) ay_sync(t_states_cycle); return ay[ay_sel].regs[ay_register%15]; }
     
     // Порты Лисиона
     else if (port == 0x00EF) { return inreg; }
@@ -74,8 +74,9 @@ unsigned char Z80Spectrum::io_read(unsigned int port) {
         }
         //D6 - отображает состояние магнитофонного входа (EAR).
         if (start_tape) {
+            tape_reads++;
             result &= 0xbf;
-            result |= getBitEar()<<6;
+            result |= tape_ear(cpu_clock) << 6;
         }
         return result;
     }
@@ -91,8 +92,8 @@ unsigned char Z80Spectrum::io_read(unsigned int port) {
 void Z80Spectrum::io_write(unsigned int port, unsigned char data) {
 
     // AY address register/data
-    if (port == 0xFFFD) { // регистр адреса 65533
-        ay_register =  (data & 15); 
+    if (port == 0xFFFD) { // регистр адреса 65533 (или выбор чипа TurboSound)
+        ay_select(data);
     } 
     else if (port == 0xBFFD) { //#BFFD - регистр данных
         ay_write_data(data);
@@ -114,6 +115,8 @@ void Z80Spectrum::io_write(unsigned int port, unsigned char data) {
         // Чтение в порт во время движения луча по бордеру
         // if (contended_mem && beam_drawing && !beam_in_paper) { cycle_counter++; }
 
+        if ((data ^ port_fe) & 0x18) beep_edge(data & 0x18);
+
         border_id = (data & 7);
         port_fe = data;
     }
@@ -1,13 +1,28 @@
 #include <iostream>
+
+// SIGINT/SIGTERM: остановиться штатно, чтобы дописать файлы записи
+volatile sig_atomic_t vm_stop = 0;
+
+static void vm_signal(int) { vm_stop = 1; }
+
+// exit() не вызывает деструктор: файлы записи дописывает этот обработчик
+static Z80Spectrum* vm_instance = NULL;
+
+static void vm_atexit() { if (vm_instance) vm_instance->shutdown(); }
+
 /**
  * Основной цикл работы VM
  */
 void Z80Spectrum::main() {
 
+    signal(SIGINT,  vm_signal);
+    signal(SIGTERM, vm_signal);
+
 #ifndef NO_SDL
     // Инициализация SDL
     if (sdl_enable) {        
         SDL_Init(SDL_INIT_EVERYTHING);
+        tb_event = SDL_RegisterEvents(1);
         //SDL_EnableUNICODE(1);
 
         //sdl_screen = SDL_SetVideoMode(3*320, 3*240, 32, SDL_HWSURFACE | SDL_DOUBLEBUF);        
@@ -23,77 +38,84 @@ void Z80Spectrum::main() {
                                SDL_PIXELFORMAT_ARGB8888,
                                SDL_TEXTUREACCESS_STREAMING,
                                3*320, 3*240);
-        pixels = (Uint32*) malloc(4*3*320*3*240);
+
+        // Задний буфер - 0, средний - 1, передний - 2
+        for (int _i = 0; _i < 3; _i++) {
+            tb_frames[_i] = (Uint32*) calloc(TB_SIZE, sizeof(Uint32));
+        }
+        tb_back  = 0;
+        tb_front = 2;
+        tb_state = 1;
+        pixels   = tb_frames[tb_back];
         //SDL_EnableKeyRepeat(500, 30);
 
-        // Количество семплов 882 x 50 = 44100
-        if (sdl_disable_sound == 0) {
+        if (sdl_disable_sound == 0) audio_open();
+
+        // Если при старте включен отладчик - перерисовать его окно
+        if (ds_viewmode == 0) { ds_cursor = ds_start = pc; disasm_repaint(); tb_publish(); }
+
+        // Эмуляция идет в отдельном потоке, здесь только события и вывод кадров
+        emu_running = 1;
+        emu_thread  = std::thread(&Z80Spectrum::emu_loop, this);
+
+        Uint32 title_ticks = 0;
+        char   title[128];
 
-            audio_device.freq     = 44100;
-            audio_device.format   = AUDIO_U8;
-            audio_device.channels = 2;
-            audio_device.samples  = 882; // два канала, #DONE: надо переделать 
-            audio_device.callback = sdl_audio_buffer;
-            audio_device.userdata = NULL;          
+        while (1) {
+
+            // Сигнал останова - как закрытие окна
+            if (vm_stop) {
 
-            if (SDL_OpenAudio(&audio_device, NULL) < 0 ) {
-            //if (SDL_OpenAudioDevice(NULL, 0, &audio_device, NULL, SDL_AUDIO_ALLOW_ANY_CHANGE) <0) {
-                fprintf(stderr, "Couldn't open audio: %s\n", SDL_GetError());                
-                exit(1);
+                SDL_Event quit;
+                quit.type = SDL_QUIT;
+                SDL_PushEvent(&quit);
+                vm_stop = 0;
             }
-            printf("Silence value:%d Buffer size:%d Format:%d\n",
-                     audio_device.silence, audio_device.size, audio_device.format);
 
-            for (int w = 0; w < MAX_AUDIOSDL_BUFFER; w++) ZXAudioBuffer[w] = 0x80; //тишина!
+            // Регистрация событий: поток спит до ввода или до нового кадра
+            // (tb_publish), таймаут - только для vm_stop и заголовка
+            if (SDL_WaitEventTimeout(&event, 100)) {
 
-            SDL_PauseAudio(0);
-        }
+                do {
+                    switch (event.type) {
 
-        // Если при старте включен отладчик - перерисовать его окно
-        if (ds_viewmode == 0) { ds_cursor = ds_start = pc; disasm_repaint(); }
-        int time_curr = SDL_GetTicks();
-        while (1) {
+                        case SDL_QUIT:
 
-            // Регистрация событий
-            while (SDL_PollEvent(&event)) {
+                            // Выдать статистику использования опкодов
+                            // for (int i = 0; i < 256; i++) printf("%08x %x \n", statistics[i], i);
+                            emu_running = 0;
+                            emu_thread.join();
+                            for (int _i = 0; _i < 3; _i++) free(tb_frames[_i]);
+                            pixels = NULL;
+                            audio_close();
+                            snap_final();
+                            return;
 
-                switch (event.type) {
+                        case SDL_KEYDOWN:
+                        case SDL_KEYUP:
 
-                    case SDL_QUIT:
+                            ev_push(&event);
+                            break;
+                    }
+                } while (SDL_PollEvent(&event));
+            }
 
-                        // Выдать статистику использования опкодов
-                        // for (int i = 0; i < 256; i++) printf("%08x %x \n", statistics[i], i);
-                        free(pixels);
-                        SDL_CloseAudio();
-                        return;
+            // Задержка звука и поправка частоты - в заголовке окна, дважды в секунду
+            if (audio_dev && SDL_GetTicks() - title_ticks >= 500) {
 
-                    case SDL_KEYDOWN: keyb(1, &event.key); break;
-                    case SDL_KEYUP:   keyb(0, &event.key); break;
-                }
+                title_ticks = SDL_GetTicks();
+                sprintf(title, "ZX Spectrum Virtual Machine - audio %.1f ms, %+.3f%%",
+                        audio_latency_us / 1000.0, audio_corr_ppm / 10000.0);
+                SDL_SetWindowTitle(sdl_screen, title);
             }
 
-            // Вычисление разности времени
-            //ftime(&ms_clock);
-            //int time_curr = ms_clock.millitm;
-            //int time_diff = time_curr - ms_clock_old;
-            int time_diff = SDL_GetTicks() - time_curr;
-            //if (time_diff < 0) time_diff += 1000;
-
-            // Если прошло 20 мс
-            if ( time_diff > 19) { // 50Гц
-                time_curr += time_diff; 
-                if (ds_viewmode) frame();
-                //ms_clock_old = time_curr;                
-                //SDL_Flip(sdl_screen);
-                SDL_UpdateTexture(sdl_texture, NULL, pixels, 3*320 * sizeof(Uint32)); // ширина строки
+            // Вывести самый свежий готовый кадр; vsync блокирует только этот поток
+            if (tb_acquire()) {
+
+                SDL_UpdateTexture(sdl_texture, NULL, tb_frames[tb_front], 3*320 * sizeof(Uint32)); // ширина строки
                 SDL_RenderCopy(sdl_renderer, sdl_texture, NULL, NULL);
-                SDL_RenderPresent(sdl_renderer);    
-                //time_diff = SDL_GetTicks() - time_curr-19;
-                //if (time_diff>0) printf("%d-", time_diff);
+                SDL_RenderPresent(sdl_renderer);
             }
-
-            // SDL_PumpEvents();
-            // SDL_Delay(1);
         }
     }
     // Выполнение спектрума из консоли
@@ -101,16 +123,145 @@ void Z80Spectrum::main() {
 #endif
     {
         if (con_frame_end == 0) con_frame_end = 150; // 3 sec
-        while (frame_counter < con_frame_end) frame();
+        while (frame_counter < con_frame_end && !vm_stop) frame();
+
+        // Снимок последнего кадра: рисуется один раз из памяти
+        if (screenshot_file) {
+
+            render_ram();
+            savebmp(screenshot_file);
+        }
+
+        snap_final();
     }
 }
 
+#ifndef NO_SDL
+// Поток эмуляции: обработка клавиш, кадры 50 Гц и публикация в тройной буфер
+void Z80Spectrum::emu_loop() {
+
+    SDL_Event ev;
+
+    pace_init();
+    while (emu_running) {
+
+        // События, переданные из главного потока
+        while (ev_pop(&ev)) {
+
+            switch (ev.type) {
+
+                case SDL_KEYDOWN: keyb(1, &ev.key); break;
+                case SDL_KEYUP:   keyb(0, &ev.key); break;
+            }
+        }
+
+        // Ожидание момента следующего кадра (поток спит, а не крутится);
+        // при загрузке с ленты кадры идут подряд
+        if (!tape_turbo || !ds_viewmode) pace_wait();
+        if (ds_viewmode) frame();
+
+        // Отдать кадр на вывод, если он был перерисован (кадр или отладчик)
+        if (tb_dirty) tb_publish();
+    }
+}
+
+// Начало отсчета времени кадров
+void Z80Spectrum::pace_init() {
+
+    pace_freq   = SDL_GetPerformanceFrequency();
+    pace_start  = SDL_GetPerformanceCounter();
+    pace_frames = 0;
+}
+
+// Ожидание следующего кадра: 50 кадров в секунду.
+// Сроки абсолютные (от pace_start), поэтому ошибки сна не накапливаются.
+void Z80Spectrum::pace_wait() {
+
+    // Ведущая - звуковая карта: новый кадр, как только callback забрал
+    // столько, что в кольце осталось не больше audio_target. Поток спит
+    // на семафоре, который поднимает callback. В отладчике кадры не
+    // идут, звук не расходуется - там остается таймер
+    if (pace_mode == 1 && audio_dev && ds_viewmode) {
+
+        while (emu_running && audio_wr.load() - audio_rd.load() > audio_target)
+            SDL_SemWaitTimeout(audio_sem, 20);
+
+        return;
+    }
+
+    pace_frames++;
+
+    Uint64 deadline = pace_start + pace_frames * pace_freq / 50;
+    Uint64 now      = SDL_GetPerformanceCounter();
+
+    // Отставание больше 5 кадров (отладчик, медленная машина) - не догонять, а начать заново
+    if (now > deadline + 5 * pace_freq / 50) {
+
+        pace_start  = now;
+        pace_frames = 0;
+        return;
+    }
+
+    while (now < deadline) {
+
+        Uint64 left_ns = (deadline - now) * 1000000000ULL / pace_freq;
+
+#ifndef _WIN32
+        // Сон до абсолютного срока на CLOCK_MONOTONIC: весь остаток кадра
+        // без опроса, сигнал (EINTR) не сдвигает срок
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        ts.tv_sec  += left_ns / 1000000000ULL;
+        ts.tv_nsec += left_ns % 1000000000ULL;
+        if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+#else
+        // Целые миллисекунды - сон, меньше миллисекунды - ожидание
+        if (left_ns >= 1000000) SDL_Delay((Uint32)(left_ns / 1000000));
+#endif
+
+        now = SDL_GetPerformanceCounter();
+    }
+}
+
+// Добавить событие в очередь (вызывается только из главного потока)
+int Z80Spectrum::ev_push(SDL_Event* ev) {
+
+    unsigned int head = ev_head.load(std::memory_order_relaxed);
+    if (head - ev_tail.load(std::memory_order_acquire) >= EV_QUEUE_SIZE)
+        return 0; // Очередь заполнена - событие теряется
+
+    ev_queue[head % EV_QUEUE_SIZE] = *ev;
+    ev_head.store(head + 1, std::memory_order_release);
+    return 1;
+}
+
+// Извлечь событие (вызывается только из потока эмуляции)
+int Z80Spectrum::ev_pop(SDL_Event* ev) {
+
+    unsigned int tail = ev_tail.load(std::memory_order_relaxed);
+    if (tail == ev_head.load(std::memory_order_acquire))
+        return 0;
+
+    *ev = ev_queue[tail % EV_QUEUE_SIZE];
+    ev_tail.store(tail + 1, std::memory_order_release);
+    return 1;
+}
+#endif
+
 // Разбор аргументов
 void Z80Spectrum::args(int argc, char** argv) {
     
     int bin_offset;    
+
+    // Файлы записи открываются здесь же: ошибка дальше в разборе их не бросит
+    vm_instance = this;
+    atexit(vm_atexit);
+
     for (int u = 1; u < argc; u++) {
-        printf("argc=%d, arg=%s \r\n", u, argv[u]);
+        fprintf(stderr, "argc=%d, arg=%s \r\n", u, argv[u]);
         // Параметр
         if (argv[u][0] == '-') {
 
@@ -130,18 +281,45 @@ void Z80Spectrum::args(int argc, char** argv) {
                     u += 2;
                     break;
 
+                // Синхронизация кадров по звуковой карте
+                case 'A': pace_mode = 1; break;
+
                 // Отключение SDL
                 case 'c': sdl_enable = 0; break;
 
                 // При загрузке включить отладчик
                 case 'd': ds_viewmode = 0; break;
 
+                // Образ SD-карты Addon.SPI
+                case 'D': spi_image = argv[u+1]; u++; break;
+
+                // Снимок экрана по окончании работы
+                case 'g': screenshot_file = argv[u+1]; u++; break;
+
+                // Снапшот по окончании: Z80, SZX или SNA по расширению
+                case 'Z': snapshot_file = argv[u+1]; u++; break;
+
                 // Остановка на HALT
                 case 'h': ds_halt_dump = 1; break;
 
                 // Нажатие на пробел через некоторое время
                 case 'k': auto_keyb = 1; break;
 
+                // Формат записи видео: bmp, y4m, rgb24
+                case 'f':
+
+                    if      (strcmp(argv[u+1], "y4m")   == 0) video_format = VIDEO_Y4M;
+                    else if (strcmp(argv[u+1], "rgb24") == 0) video_format = VIDEO_RGB24;
+                    else video_format = VIDEO_BMP;
+                    u++;
+                    break;
+
+                // Частота кадров в заголовке Y4M
+                case 'F':
+
+                    sscanf(argv[u+1], "%d", &con_frame_fps); u++;
+                    break;
+
                 // Пропуск кадров
                 case 'm':
 
@@ -161,11 +339,57 @@ void Z80Spectrum::args(int argc, char** argv) {
                     if (strcmp(argv[u+1],"-") == 0) {
                         record_file = stdout;
                     } else {
-                        record_file = fopen(argv[u+1], "w+");
+                        record_file = fopen(argv[u+1], "wb+");
                     }
                     u++;
                     break;
 
+                // Размер очереди записи (кадров)
+                case 'q':
+
+                    sscanf(argv[u+1], "%d", &rec_slots); u++;
+                    break;
+
+                // Поведение при переполнении очереди записи
+                case 'Q':
+
+                    if      (strcmp(argv[u+1], "oldest") == 0) rec_policy = REC_DROP_OLDEST;
+                    else if (strcmp(argv[u+1], "dup")    == 0) { rec_policy = REC_DROP_DUP; if (!skip_dup_frame) skip_dup_frame = 2; }
+                    else rec_policy = REC_BLOCK;
+                    u++;
+                    break;
+
+                // Желаемая задержка звука, мс
+                case 'L':
+
+                    sscanf(argv[u+1], "%d", &audio_latency); u++;
+                    break;
+
+                // Частота вывода звука
+                case 'R':
+
+                    sscanf(argv[u+1], "%d", &audio_rate); u++;
+                    audio_rate = audio_rate < 8000 ? 8000 : (audio_rate > AUDIO_RATE_MAX ? AUDIO_RATE_MAX : audio_rate);
+                    audio_rate -= audio_rate % 50;
+                    blip_init();
+                    break;
+
+                // Раскладка каналов AY по стерео
+                case 'P':
+
+                    if      (strcmp(argv[u+1], "acb")  == 0) ay_pan_init(AY_LAYOUT_ACB);
+                    else if (strcmp(argv[u+1], "mono") == 0) ay_pan_init(AY_LAYOUT_MONO);
+                    else ay_pan_init(AY_LAYOUT_ABC);
+                    u++;
+                    break;
+
+                // Громкость, проценты
+                case 'V':
+
+                    sscanf(argv[u+1], "%f", &audio_gain); u++;
+                    audio_gain /= 100;
+                    break;
+
                 // Установка регистра PC (hex)
                 case 'p':
 
@@ -184,31 +408,58 @@ void Z80Spectrum::args(int argc, char** argv) {
                 // Файл для записи звука
                 case 'w':
 
-                    wave_file = fopen(argv[u+1], "wb");
-                    if (wave_file == NULL) { printf("Can't open file %s for writing\n", argv[u+1]); exit(1); }
-                    fseek(wave_file, 44, SEEK_SET);
+                    wav_open(argv[u+1]);
+                    u++;
+                    break;
+
+                // Формат WAV: s16 | f32, с добавкой mono
+                case 'W':
+
+                    wav_float = (strstr(argv[u+1], "f32")  != NULL);
+                    wav_mono  = (strstr(argv[u+1], "mono") != NULL);
                     u++;
                     break;
 
                 // Отключение звука
                 case 'x': sdl_disable_sound = 1; break;
 
+                // Быстрая загрузка с ленты
+                case 't': tape_flash = 1; break;
+
+                // Без автотурбо при загрузке
+                case 'T': tape_turbo_on = 0; break;
+
+                // Запись на ленту: TAP или TZX
+                case 'S':
+
+                    save_open(argv[u+1]);
+                    u++;
+                    break;
+
+                // Журнал звуковых событий для aybench
+                case 'e':
+
+                    aev_open(argv[u+1]);
+                    u++;
+                    break;
+
+                // Запись регистров AY в PSG вместо звука
+                case 'y':
+
+                    psg_open(argv[u+1]);
+                    u++;
+                    break;
+
                 // Активация моно
-                case 'z': ay_mono = 1; break;
+                case 'z': ay_pan_init(AY_LAYOUT_MONO); break;
             }
 
         }
-        // Загрузка файла
-        else if (strstr(argv[u], ".z80") != NULL) {
-            loadz80(argv[u]);
-        }
-        // Загрузка файла BAS с ленты
-        else if (strstr(argv[u], ".tap") != NULL) {
-            loadtap(argv[u]);
-        }
-        // Загрузка файла SNA
-        else if (strstr(argv[u], ".sna") != NULL) {
-            loadsna(argv[u]);
+        // Снапшот, лента или экран: формат по содержимому
+        else {
+
+            int status = load_file(argv[u]);
+            if (status != LOAD_OK) { printf("Can't load file %s: %s\n", argv[u], load_message(status)); exit(1); }
         }
     }
 }
@@ -348,11 +599,11 @@ void Z80Spectrum::keyb(int press, SDL_KeyboardEvent* eventkey) {
             if (press)
             switch (key) {
 
-                case SDLK_F2: savesna("autosave.sna"); break;
-                case SDLK_F3: loadsna("autosave.sna"); break;
+                case SDLK_F2: snap_background("autosave.z80"); break;
+                case SDLK_F3: if (load_file("autosave.z80") != LOAD_OK) printf("Can't load autosave.z80\n"); break;
                 case SDLK_F4: 
                     if (tapsize>0) {
-                        start_tape = !start_tape; if (start_tape) initTape();
+                        if (start_tape) start_tape = 0; else tape_play();
                     } else {
                         printf("Tap file is not loaded!\n");    
                     }
@@ -376,6 +627,7 @@ void Z80Spectrum::keyb(int press, SDL_KeyboardEvent* eventkey) {
                         ts = run_instruction();
                         t_states_cycle += ts;
                         t_states_all   += ts;
+                        cpu_clock      += ts;
                         ds_cursor = pc;
                     }
 
@@ -397,4 +649,185 @@ void Z80Spectrum::keyb(int press, SDL_KeyboardEvent* eventkey) {
 
     if (inreg && press) klatch ^= 1;
 }
+// -----------------------------------------------------------------
+// Вывод звука
+// -----------------------------------------------------------------
+
+static void sdl_audio_buffer(void* userdata, Uint8* stream, int len) {
+    ((Z80Spectrum*) userdata)->audio_callback(stream, len);
+}
+
+// Открыть устройство: частота, формат (S16 или float) и размер буфера -
+// какие дает устройство. Синтез переходит на выданную частоту.
+void Z80Spectrum::audio_open() {
+
+    SDL_AudioSpec want;
+    int allow = SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE;
+
+    SDL_zero(want);
+    want.freq     = audio_rate;
+    want.format   = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples  = pace_mode == 1 ? 256 : 512;   // Ведущей карте хватает малого буфера
+    want.callback = sdl_audio_buffer;
+    want.userdata = this;
+
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &audio_device, allow);
+
+    // Другие форматы и частоты вне диапазона пусть преобразует SDL
+    if (audio_dev && ((audio_device.format != AUDIO_S16SYS && audio_device.format != AUDIO_F32SYS) ||
+                       audio_device.freq < 8000 || audio_device.freq > AUDIO_RATE_MAX)) {
+
+        SDL_CloseAudioDevice(audio_dev);
+        audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &audio_device, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    }
+
+    if (audio_dev == 0) {
+        fprintf(stderr, "Couldn't open audio: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    if (audio_device.freq != audio_rate) {
+
+        audio_rate = audio_device.freq;
+        blip_init();
+    }
+
+    // Целевое заполнение: не меньше буфера устройства и одного кадра.
+    // Когда кадры запрашивает сама карта (-A), ровно столько
+    unsigned int audio_floor = audio_device.samples + audio_rate / 50;
+
+    audio_target = audio_rate * audio_latency / 1000;
+    if (audio_target < audio_floor || pace_mode == 1)
+        audio_target = audio_floor;
+
+    audio_sem = SDL_CreateSemaphore(0);
+
+    // Сверх двойной цели - уже задержка, а не запас
+    audio_limit = 2 * audio_target + audio_device.samples;
+    if (audio_limit > AUDIO_RING) audio_limit = AUDIO_RING;
+    drc_fill = audio_target;
+
+    fprintf(stderr, "Audio: %d Hz, %s, buffer %d samples\n", audio_device.freq,
+            audio_device.format == AUDIO_F32SYS ? "float" : "s16", audio_device.samples);
+
+    SDL_PauseAudioDevice(audio_dev, 0);
+}
+
+void Z80Spectrum::audio_close() {
+
+    if (audio_dev == 0) return;
+
+    SDL_CloseAudioDevice(audio_dev);
+    SDL_DestroySemaphore(audio_sem);
+    audio_dev = 0;
+    audio_sem = NULL;
+
+    fprintf(stderr, "Audio: underruns %u, overruns %u, latency %.1f ms, correction %+.3f%%\n",
+            audio_underruns.load(), audio_overruns.load(),
+            audio_latency_us / 1000.0, audio_corr_ppm / 10000.0);
+}
+
+// Callback SDL (поток звука): единственный читатель кольца
+void Z80Spectrum::audio_callback(Uint8* stream, int len) {
+
+    int          fl    = (audio_device.format == AUDIO_F32SYS);
+    int          count = len / (fl ? 2*sizeof(float) : 2*sizeof(short));
+    unsigned int rd    = audio_rd.load(std::memory_order_relaxed);
+    unsigned int wr    = audio_wr.load(std::memory_order_acquire);
+
+    // Сначала кольцо набирает целевое заполнение, потом нехватка - это underrun
+    if (!audio_started) {
+
+        if (wr - rd < audio_target) wr = rd;
+        else audio_started = 1;
+    }
+    else if (wr - rd < (unsigned int) count) audio_underruns++;
+
+    for (int _i = 0; _i < count; _i++) {
+
+        short l = 0, r = 0;
+
+        if (rd != wr) {
+
+            l = audio_ring[2*(rd % AUDIO_RING)];
+            r = audio_ring[2*(rd % AUDIO_RING) + 1];
+            rd++;
+        }
+
+        if (fl) {
+            ((float*) stream)[2*_i]     = l * (1.0f / 32768);
+            ((float*) stream)[2*_i + 1] = r * (1.0f / 32768);
+        } else {
+            ((short*) stream)[2*_i]     = l;
+            ((short*) stream)[2*_i + 1] = r;
+        }
+    }
+
+    audio_rd.store(rd, std::memory_order_release);
+
+    // Разбудить эмуляцию, если кадры запрашивает карта
+    if (pace_mode == 1 && wr - rd <= audio_target && SDL_SemValue(audio_sem) == 0)
+        SDL_SemPost(audio_sem);
+}
+
+// Семплы кадра в кольцо (поток эмуляции - единственный писатель)
+void Z80Spectrum::audio_push(const short* data, int n) {
+
+    unsigned int wr   = audio_wr.load(std::memory_order_relaxed);
+    unsigned int fill = wr - audio_rd.load(std::memory_order_acquire);
+    int          room = fill < audio_limit ? audio_limit - fill : 0;
+
+    audio_drc(fill);
+
+    // Кольцо полно: хвост кадра теряется
+    if (n > room) {
+
+        audio_overruns += n - room;
+        n = room;
+    }
+
+    for (int _i = 0; _i < n; _i++) {
+
+        audio_ring[2*((wr + _i) % AUDIO_RING)]     = data[2*_i];
+        audio_ring[2*((wr + _i) % AUDIO_RING) + 1] = data[2*_i + 1];
+    }
+
+    audio_wr.store(wr + n, std::memory_order_release);
+}
+
+// Эмуляция идет по таймеру, а звуковая карта по своему кварцу: их частоты
+// расходятся. Длина следующего кадра в семплах чуть меняется (не больше
+// DRC_MAX), чтобы заполнение кольца держалось у audio_target.
+void Z80Spectrum::audio_drc(unsigned int fill) {
+
+    // Callback забирает блоками, поэтому заполнение сглаживается
+    drc_fill += ((double) fill - drc_fill) * 0.05;
+
+    double err = ((double) audio_target - drc_fill) / audio_target;
+    if (err >  1) err =  1;
+    if (err < -1) err = -1;
+
+    // Пропорциональная часть и медленный интеграл - постоянная разница
+    // частот уходит в интеграл, заполнение возвращается к цели
+    drc_integ += err * DRC_MAX * 0.005;
+    if (drc_integ >  DRC_MAX) drc_integ =  DRC_MAX;
+    if (drc_integ < -DRC_MAX) drc_integ = -DRC_MAX;
+
+    double corr = err * DRC_MAX + drc_integ;
+    if (corr >  DRC_MAX) corr =  DRC_MAX;
+    if (corr < -DRC_MAX) corr = -DRC_MAX;
+
+    // Синхронизация по звуковой карте (-A) сама держит заполнение
+    if (pace_mode == 1) corr = drc_integ = 0;
+
+    // Удлиненный кадр с дробным хвостом - не больше AUDIO_FRAME_MAX семплов:
+    // под это число выделены blip_buf, audio_pcm и audio_mix
+    static_assert(AUDIO_FRAME_MAX > AUDIO_RATE_MAX/50*(1 + DRC_MAX), "AUDIO_FRAME_MAX is less than a DRC-stretched frame");
+
+    blip_frame_len = llround((double) audio_rate * BLIP_PHASES / 50 * (1 + corr));
+
+    audio_latency_us = (int)((drc_fill + audio_device.samples) * 1000000 / audio_rate);
+    audio_corr_ppm   = (int)(corr * 1000000);
+}
 #endif
@@ -3,43 +3,45 @@
  * Общая область: 352x296
  */
 
+// Частота вывода звука (-R)
+#define AUDIO_RATE_MAX  192000
+
+// Подстройка частоты звука под заполнение кольца: не больше +-0.5%
+#define DRC_MAX         0.005
+
+// Семплов в кадре: подстройка удлиняет кадр до DRC_MAX, и еще семпл -
+// на дробную часть, накопленную с прошлых кадров
+#define AUDIO_FRAME_MAX ((int)(AUDIO_RATE_MAX/50*(1 + DRC_MAX)) + 1)
+
 //#include <sys/timeb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "fonts.h"
 
 #ifndef NO_SDL
 
-#define MAX_AUDIOSDL_BUFFER 882*16
+// Кольцо звука: стереосемплов, степень двойки
+#define AUDIO_RING      16384
 
-// Циклический буфер
-int           AudioSDLFrame;
-int           AudioZXFrame;
-unsigned char ZXAudioBuffer[MAX_AUDIOSDL_BUFFER];
+// Тройной буфер кадров: бит "в среднем буфере свежий кадр"
+#define TB_FRESH        4
+#define TB_SIZE         (3*320*3*240)
 
-// Аудиобуфер
-void sdl_audio_buffer(void* unused, unsigned char* stream, int len) {
+// Очередь событий от главного потока к потоку эмуляции
+#define EV_QUEUE_SIZE   256
 
-    // Выдача данных
-    for (int w = 0; w < 882*2; w++) {
-
-        int v = ZXAudioBuffer[2*882*AudioSDLFrame + w];
-        stream[w] = v;
-    }    
-
-    // К следующему (если можно)
-    if (AudioSDLFrame != AudioZXFrame) {
-        AudioSDLFrame = (AudioSDLFrame + 1) % 8;
-    }
-    // Если догнал - то отстать на несколько кадров
-    else {
-        AudioSDLFrame = ((AudioZXFrame + 8) - 4) % 8;
-    }
-}
 #endif
 
 // AY-3-8910 Уровни
@@ -76,21 +78,215 @@ struct __attribute__((__packed__)) BITMAPINFOHEADER {
     unsigned int   biClrImportant;  // 0
 };
 
-// 44 байта https://audiocoding.ru/articles/2008-05-22-wav-file-structure/
+// Состояние одного AY-3-8910 (у TurboSound их два)
+struct AYChip {
+    int regs[16], amp[3];
+    int latch;                  // Регистр адреса, пока выбран другой чип
+    int tone_tick[3], tone_period[3], tone_high[3];
+    int noise_toggle, noise_period, rng, noise_tick;
+    int env_tick, env_period, env_first, env_rev, env_counter;
+    int env_internal_tick, env_cycles;
+    int dirty;                  // Выход может измениться на ближайшем тике
+};
+
+// Раскладка каналов по стерео (-P)
+#define AY_LAYOUT_ABC   0
+#define AY_LAYOUT_ACB   1
+#define AY_LAYOUT_MONO  2
+
+// Выше этого уровня (доля полной шкалы) включается мягкое ограничение
+#define AUDIO_KNEE      0.85f
+
+// Запись в регистр AY с тактом внутри кадра
+#define AY_EVENTS       1024
+
+struct AYEvent {
+    int t;
+    int reg;        // Номер чипа << 4 | регистр
+    int data;
+};
+
+// Перепад на бипере: запись в порт FE, изменившая EAR/MIC
+#define BEEP_EDGES      (71680/8)   // Не больше одной записи на инструкцию
+
+struct BeepEdge {
+    int t;
+    int bits;       // Биты EAR (0x10) и MIC (0x08) порта FE
+    long long clock;    // Такт cpu_clock: по нему запись на ленту меряет импульсы
+};
+
+// Band-limited синтез: ступенька раскладывается по BLIP_WIDTH семплам,
+// момент внутри семпла различается с точностью 1/BLIP_PHASES
+#define BLIP_PHASES     32
+#define BLIP_WIDTH      16
+#define BLIP_BITS       12                          // Сумма ядра = 1 << BLIP_BITS
+#define BLIP_BUF        (AUDIO_FRAME_MAX + 2*BLIP_WIDTH)
+#define BLIP_FRAME      71680                       // Тактов в кадре
+
+// Уровни на выходе (16 бит со знаком)
+#define AY_SCALE        48      // Канал: 0..256 -> (A + B/2) * 48 <= 18432
+#define BEEP_EAR        8192
+#define BEEP_MIC        2048
+
+// Журнал звуковых событий (-e): после заголовка записи по AEV_RECORD байт -
+// код, значение, такт кадра (24 бита). Код: номер чипа << 4 | регистр AY,
+// AEV_BEEP - биты EAR/MIC порта FE, AEV_FRAME - конец кадра
+#define AEV_HEADER      8
+#define AEV_RECORD      5
+#define AEV_BEEP        0x20
+#define AEV_FRAME       0xFF
+
+// Формат файла (load_file узнает по содержимому)
+#define FILE_UNKNOWN    0
+#define FILE_SNA        1
+#define FILE_Z80        2
+#define FILE_SZX        3
+#define FILE_TAP        4
+#define FILE_TZX        5
+#define FILE_PZX        6
+#define FILE_SCR        7
+
+// Результат load_file
+#define LOAD_OK          0
+#define LOAD_NO_FILE     1
+#define LOAD_UNKNOWN     2
+#define LOAD_BROKEN      3      // Обрезан или испорчен
+#define LOAD_UNSUPPORTED 4      // Машина не 48K/128K
+
+// Снимок машины для записи Z80/SZX (snapshot.cc)
+struct SnapState {
+    int a, f, b, c, d, e, h, l;
+    int a_, f_, b_, c_, d_, e_, h_, l_;
+    int ix, iy, sp, pc, i, r;
+    int iff1, iff2, imode, halted;
+    int border, port_fe, port_7ffd;
+    int is128;
+    int ay_sel, ay_chips;
+    int ay_cur[2], ay_regs[2][16];  // Выбранный регистр и регистры обоих чипов
+    unsigned char memory[128*1024];
+};
+
+// Лента: тайминги ПЗУ в тактах
+#define TAPE_PILOT      2168
+#define TAPE_PILOT_HDR  8063    // Импульсов пилота перед заголовком
+#define TAPE_PILOT_DATA 3223    // ... перед блоком данных
+#define TAPE_SYNC1      667
+#define TAPE_SYNC2      735
+#define TAPE_BIT0       855     // Бит - два импульса
+#define TAPE_BIT1       1710
+#define TAPE_MS         3500    // Тактов в миллисекунде: паузы TZX в мс
+#define TAPE_PAUSE      1000    // Пауза после блока TAP, мс
+#define TAPE_PAUSE_EDGE 3500    // Высокий уровень перед паузой, 1 мс
+#define TAPE_NEVER      0x7FFFFFFFFFFFFFFFLL
+#define TAPE_CHUNK      4096    // Отрезков в порции генератора
+#define TAPE_GEN_LIMIT  100000  // Шагов без единого импульса: зациклена
+
+// Автотурбо: кадр с таким числом чтений порта FE при движущейся ленте -
+// загрузка; скорость возвращается через TAPE_TURBO_HOLD кадров без нее.
+// Пока идет загрузка, на экран попадает каждый TAPE_TURBO_SHOW-й кадр
+#define TAPE_TURBO_READS 256
+#define TAPE_TURBO_HOLD  25
+#define TAPE_TURBO_SHOW  16
+
+// Запись на ленту (-S): блок кончается, когда перепадов MIC нет 50 мс;
+// пилот короче SAVE_PILOT_MIN - не стандартный блок, меньше SAVE_DR_MIN
+// импульсов - щелчки, а не запись. Прямая запись TZX - семпл на 79 тактов
+#define SAVE_GAP        175000
+#define SAVE_PILOT_MIN  256
+#define SAVE_DR_MIN     256
+#define SAVE_DR_RATE    79
+
+// SD-карта Addon.SPI: кэш секторов образа; измененные сектора уходят в
+// образ не позже чем через SPI_FLUSH_FRAMES кадров (1 с)
+#define SPI_CACHE        128
+#define SPI_FLUSH_FRAMES 50
+
+struct SpiLine {
+    int      lba;       // -1 - строка пуста
+    int      dirty;
+    unsigned used;      // Время последнего обращения
+    unsigned char data[512];
+};
+
+// Формат файла ленты
+#define TAPE_TAP        0
+#define TAPE_TZX        1
+#define TAPE_PZX        2
+
+// Типы блоков: ID блока TZX, для TAP и PZX - свои
+#define TAPE_TAP_BLOCK  0x100
+#define TAPE_PZX_PULS   0x101
+#define TAPE_PZX_DATA   0x102
+#define TAPE_PZX_PAUS   0x103
+#define TAPE_PZX_STOP   0x104
+#define TAPE_PZX_INFO   0x105   // PZXT, BRWS и неизвестные
+
+// Отрезок ленты: count импульсов по len тактов, в конце каждого перепад
+struct TapeSeg {
+    int len;
+    int count;
+};
+
+// Блок ленты: тело блока в tapfile (после ID, для PZX - после длины)
+struct TapeBlock {
+    int type;
+    int pos;
+    int size;
+};
+
+// Блок данных (TAP, TZX 0x10, 0x11, 0x14): тайминги и байты в tapfile
+struct TapeData {
+    int pilot, pilots;
+    int sync1, sync2;
+    int bit0, bit1;
+    int data, size;     // Байты вместе с флагом и контрольной суммой
+    int bits;           // Всего бит: в последнем байте может быть меньше 8
+    int pause;          // мс
+};
+
+// Форматы записи видеопотока (-f)
+#define VIDEO_BMP       0   // BMP на каждый кадр
+#define VIDEO_Y4M       1   // YUV4MPEG2, 4:4:4, один заголовок на поток
+#define VIDEO_RGB24     2   // Сырые кадры rgb24 без заголовков
+
+// Политика записи при переполненной очереди (-Q)
+#define REC_BLOCK       0   // Ждать записи на диск
+#define REC_DROP_OLDEST 1   // Выбросить самый старый кадр из очереди
+#define REC_DROP_DUP    2   // Выбрасывать только повторные кадры
+
+// Буфер очереди записи: один кадр или звук одного кадра
+#define REC_SLOT_SIZE   (320*240*3 + 64)
+
+struct RecSlot {
+    FILE*           fp;         // Куда писать
+    int             size;       // Заполнено байт
+    int             video;      // 1=кадр 0=звук
+    unsigned char*  data;
+};
+
+// Заголовок WAV: 80 байт https://audiocoding.ru/articles/2008-05-22-wav-file-structure/
+// Место под ds64 занято чанком JUNK; если данных больше 4 Гб, заголовок
+// переписывается в RF64 (EBU Tech 3306) без сдвига данных
 struct __attribute__((__packed__)) WAVEFMTHEADER {
 
-    unsigned int    chunkId;        // RIFF 0x52494646
-    unsigned int    chunkSize;
-    unsigned int    format;         // WAVE 0x57415645
-    unsigned int    subchunk1Id;    // fmt (0x666d7420)
+    unsigned int    chunkId;        // RIFF 0x46464952 | RF64 0x34364652
+    unsigned int    chunkSize;      // 0xFFFFFFFF для RF64 и потока
+    unsigned int    format;         // WAVE 0x45564157
+    unsigned int    ds64Id;         // ds64 0x34367364 | JUNK 0x4B4E554A
+    unsigned int    ds64Size;       // 28
+    unsigned long long riffSize64;
+    unsigned long long dataSize64;
+    unsigned long long sampleCount64;
+    unsigned int    tableLength;    // 0
+    unsigned int    subchunk1Id;    // fmt (0x20746d66)
     unsigned int    subchunk1Size;  // 16
-    unsigned short  audioFormat;    // 1
-    unsigned short  numChannels;    // 2
-    unsigned int    sampleRate;     // 44100
-    unsigned int    byteRate;       //
-    unsigned short  blockAlign;     //
-    unsigned short  bitsPerSample;  //
-    unsigned int    subchunk2Id;    // data 0x64617461
+    unsigned short  audioFormat;    // 1 PCM | 3 float
+    unsigned short  numChannels;    // 1 | 2
+    unsigned int    sampleRate;
+    unsigned int    byteRate;
+    unsigned short  blockAlign;
+    unsigned short  bitsPerSample;
+    unsigned int    subchunk2Id;    // data 0x61746164
     unsigned int    subchunk2Size;  // Количество байт в области данных.
 };
 
@@ -103,8 +299,35 @@ protected:
     SDL_Window*     sdl_screen;
     SDL_Renderer*   sdl_renderer;
     SDL_Texture*    sdl_texture; 
-    Uint32*         pixels; 
-    SDL_AudioSpec   audio_device;
+    Uint32*         pixels;             // Задний буфер, в него рисует эмуляция
+    SDL_AudioSpec   audio_device;       // Формат, выданный устройством
+    SDL_AudioDeviceID audio_dev;
+    SDL_sem*        audio_sem;          // Callback будит эмуляцию (-A)
+
+    // Кольцо звука: пишет поток эмуляции, читает callback SDL
+    short           audio_ring[2*AUDIO_RING];
+    std::atomic<unsigned int> audio_wr, audio_rd;   // Счетчики стереосемплов
+    unsigned int    audio_limit;        // Предел заполнения, сверх него - overrun
+    unsigned int    audio_target;       // Желаемое заполнение (-L)
+    int             audio_started;      // Кольцо набрало audio_target (поток звука)
+    std::atomic<unsigned int> audio_underruns, audio_overruns;
+    double          drc_fill;           // Сглаженное заполнение кольца
+    double          drc_integ;          // Накопленная поправка
+    std::atomic<int> audio_latency_us;  // Для заголовка окна: задержка
+    std::atomic<int> audio_corr_ppm;    // и поправка частоты
+
+    // Тройной буфер и поток эмуляции
+    Uint32*         tb_frames[3];
+    int             tb_back, tb_front;  // Задний принадлежит эмуляции, передний - выводу
+    int             tb_dirty;           // В заднем буфере нарисован новый кадр
+    std::atomic<int> tb_state;          // Индекс среднего буфера | TB_FRESH
+    Uint32          tb_event;           // Событие "есть свежий кадр" для потока вывода
+    std::atomic<int> emu_running;
+    std::thread     emu_thread;
+
+    // События клавиатуры (один писатель - один читатель)
+    SDL_Event       ev_queue[EV_QUEUE_SIZE];
+    std::atomic<unsigned int> ev_head, ev_tail;
 #endif
 
 // -----------------------------------------------------------------
@@ -117,6 +340,7 @@ protected:
 
     int     t_states_cycle;
     long    t_states_all;
+    long long cpu_clock;        // Такты самого ЦП от запуска: по ним идет лента
     int     port_7ffd;
     int     trdos_latch;
 
@@ -138,6 +362,7 @@ protected:
     int     flash_state, flash_counter;
     Uint32    border_id, port_fe;
     int     diff_prev_frame;
+    int     frame_render;       // Текущий кадр будет показан или записан
 
 // -----------------------------------------------------------------
 // Свойства: Эмуляция
@@ -149,36 +374,133 @@ protected:
     int     auto_keyb, skip_dup_frame;
     int     contended_mem;
     FILE*   record_file;
+    int     video_format;         // VIDEO_BMP | VIDEO_Y4M | VIDEO_RGB24
+    int     record_header;        // Заголовок потока уже записан
+    unsigned char pal_yuv[16][3]; // Палитра в Y'CbCr (BT.601)
     int     frame_id;
+    const char* screenshot_file;  // Снимок экрана по окончании (-g)
+    const char* snapshot_file;    // Снапшот по окончании (-Z)
+    std::thread snap_thread;      // Фоновая запись снапшота (F2)
+    int     shutdown_done;          // Файлы записи уже дописаны (shutdown)
     int     first_sta;            // Досрочно обновить экран
     int     autostart;            // Автостарт при запуске
     int     frame_counter;        // Количество кадров от начала
     int     lookupfb[192];        // Для более быстрого определения адреса
     char    strbuf[256];
     int     start_tape;         // запуск магнитофона
-    unsigned char tapfile[64*1024];
-    int     st_tape;            // машина состояний загрузки
-    int     pos_tape;           // позиция в тап файле для загрузки
-    int     tapsize;            // размер файла тап
+    const unsigned char* tapfile;   // Файл ленты, отображенный в память
+    int     tapsize;            // размер файла ленты
+    int        tape_format;     // TAPE_TAP | TAPE_TZX | TAPE_PZX
+    int        tape_scan;       // Оглавление: начало неразобранной части
+    TapeBlock* tape_blocks;
+    int        tape_block_count, tape_block_max;
+    TapeSeg*   tape_segs;       // Порция ленты импульсами (tape.cc)
+    int        tape_seg_count, tape_seg_max;
+    int        tape_chunk_block;    // Блок, с которого начата порция
+    int        tape_chunk_first;    // ... с его начала
+    int        tape_chunk_lead;     // Отрезков предыдущего блока в начале
+    int        tape_chunk_level;    // Уровень первого отрезка
+    int        tape_gen_block;  // Генератор: блок, этап, позиция в этапе
+    int        tape_gen_stage, tape_gen_pos;
+    int        tape_gen_level;  // Уровень линии после уже собранного
+    int        tape_gen_stop;   // Дошел до блока остановки
+    int        tape_pend_len;   // Последний интервал: длина еще растет
+    int        tape_pend_level;
+    int        tape_loop_block, tape_loop_left;
+    int        tape_call_block, tape_call_pos;
+    int        tape_seg;        // Курсор: текущий отрезок
+    int        tape_left;       // Импульсов до конца отрезка, включая текущий
+    long long  tape_edge;       // Конец текущего импульса, такт cpu_clock
+    int        tape_level;      // Уровень EAR
+    int        tape_flash;      // Быстрая загрузка: перехват LD-BYTES (-t)
+    int        tape_quiet;      // Не печатать формат и заголовки при открытии
+    int        tape_turbo_on;   // Автотурбо при загрузке (-T выключает)
+    int        tape_turbo;      // Идет загрузка: кадры без ожидания и без звука
+    int        tape_reads;      // Чтений порта FE за кадр при движущейся ленте
+    int        tape_idle;       // Кадров без загрузки подряд
+    FILE*      save_file;       // Запись на ленту (-S): TAP или TZX
+    int        save_tzx;
+    int        save_blocks;     // Записано блоков
+    int*       mic_pulses;      // Импульсы MIC текущего блока, тактов
+    int        mic_count, mic_max;
+    int        mic_edges;       // Перепадов в блоке, 0 - блока нет
+    int        mic_level;       // Уровень MIC до первого перепада
+    long long  mic_last;        // Последний перепад, такт cpu_clock
+    int        mic_seen;        // Сколько перепадов из beep_edges уже разобрано
 
 // -----------------------------------------------------------------
 // Свойства: Звук
 // -----------------------------------------------------------------
 
-    int     ab_cursor;
     int     sdl_disable_sound;
-    int     t_states_wav, max_audio_cycle;
     FILE*   wave_file;
-    int     ay_register, ay_last_data, ay_regs[16], ay_amp[3];
-    int     ay_tone_tick[3], ay_tone_period[3], ay_tone_high[3];
+    int     ay_register, ay_last_data;
     int     ay_tone_levels[16];
-    int     ay_noise_toggle, ay_noise_period, ay_rng;
-    int     ay_noise_tick, ay_env_tick, ay_env_period;
-    int     ay_env_first, ay_env_rev, ay_env_counter;
-    int     ay_env_internal_tick, ay_env_cycles, ay_mono;
+    AYChip  ay[2];              // TurboSound: два чипа
+    int     ay_sel;             // Выбранный чип
+    int     ay_chips;           // Сколько чипов микшируется (1, после выбора второго - 2)
+    int     ay_pan[6][2];       // Веса каналов A..C обоих чипов в L/R, 1/256
+    int     ay_synth;           // Есть потребитель звука - AY надо синтезировать
+    int     ay_reference;       // Каждый тик через ay_tick, без пропусков (aybench -x)
+    int     ay_t_pos;           // До какого такта кадра просчитан AY
+    int     ay_event_count;
+    AYEvent ay_events[AY_EVENTS];
+    int     ay_out[2];          // Вклад AY в уровень L/R
+    BeepEdge beep_edges[BEEP_EDGES];    // Перепады бипера за кадр
+    int     beep_edge_count;
+    int     beep_level;         // EAR/MIC до первого перепада в списке
+
+    int     audio_rate;         // Частота вывода (-R)
+    int     audio_latency;      // Желаемая задержка звука, мс (-L)
+    long long blip_frame_len;   // Длина кадра в 1/BLIP_PHASES семпла
+    long long blip_pos;         // Начало кадра в 1/BLIP_PHASES семпла
+    long long blip_base;        // Номер семпла blip_buf[*][0]
+    int     blip_buf[2][BLIP_BUF];  // Перепады уровня L/R, свернутые с ядром
+    int     blip_acc[2];        // Интеграторы
+    short   audio_pcm[2*AUDIO_FRAME_MAX];       // Семплы кадра, 16 бит
+    float   audio_mix[2][BLIP_BUF];     // После интегратора и DC-фильтра
+    short   audio_chan[2][BLIP_BUF];    // После ограничителя, по каналам
+    float   audio_gain;         // Громкость (-V)
+    float   dc_x[2], dc_y[2], dc_r; // Срез постоянной составляющей
+
+    int         wav_float;      // -W f32: float вместо 16 бит
+    int         wav_mono;       // -W mono: один канал
+    int         wav_seekable;   // Файл, а не канал: заголовок переписывается в конце
+    int         wav_header;     // Начальный заголовок уже записан
+    unsigned long long wav_bytes;   // Байт в области данных
+    RecSlot*    wav_slot;       // Набираемый блок
+    FILE*       psg_file;       // Запись регистров AY (-y)
+    RecSlot*    psg_slot;
+    int         psg_waits;      // Долг по маркерам конца кадра
+    FILE*       aev_file;       // Журнал звуковых событий (-e)
+    RecSlot*    aev_slot;
+    int         aev_started;    // Начальное состояние уже записано
+
+// -----------------------------------------------------------------
+// Свойства: Асинхронная запись (-o, -w)
+// -----------------------------------------------------------------
 
-    unsigned char audio_frame[44100];
-    unsigned int  wav_cursor;
+    int         rec_slots;          // Размер пула буферов (-q)
+    int         rec_policy;         // REC_BLOCK | REC_DROP_OLDEST | REC_DROP_DUP
+    RecSlot*    rec_pool;           // Буферы выделяются один раз
+    int*        rec_free;           // Кольцо свободных (пишет поток записи)
+    int*        rec_queue;          // Кольцо на запись (пишет эмуляция)
+    std::atomic<unsigned int> rec_free_head, rec_free_tail;
+    std::atomic<unsigned int> rec_q_head, rec_q_tail;
+    std::atomic<int> rec_running;
+    std::thread     rec_thread;
+    std::mutex      rec_mutex;
+    std::condition_variable rec_cv;
+    unsigned int    rec_frames, rec_dropped, rec_stalls, rec_max_depth;
+
+// -----------------------------------------------------------------
+// Свойства: Синхронизация кадров
+// -----------------------------------------------------------------
+
+    int     pace_mode;          // 0=Таймер 1=Ведущая звуковая карта (-A)
+    Uint64  pace_freq;          // Частота высокоточного счетчика
+    Uint64  pace_start;         // Момент отсчета
+    Uint64  pace_frames;        // Кадров от момента отсчета
 
 // -----------------------------------------------------------------
 // Property: Disassembler
@@ -216,6 +538,12 @@ protected:
     int     spi_lba;
     FILE    *spi_file;
     unsigned char spi_sector[512];
+    const char* spi_image;          // Образ SD-карты (-D)
+    int     spi_card;               // 1 - образ открыт, -1 - нет образа
+    long long spi_sectors;
+    SpiLine spi_cache[SPI_CACHE];
+    unsigned spi_tick;
+    int     spi_dirty, spi_frames;
 
 // -----------------------------------------------------------------
 // Методы: Эмуляция и память
@@ -227,7 +555,6 @@ protected:
 
     int     get_bank    (int address);
     int     c48k_address(int address, int mode);
-    int     z80file_bankmap(int mode, int bank);
 
     void    put48mem_byte(int address, unsigned char value)  { memory[c48k_address(address, 1)] = value; }
     void    put48mem_word(int address, unsigned short value) { put48mem_byte(address, value); put48mem_byte(address+1, value>>8); }
@@ -244,9 +571,26 @@ protected:
 // -----------------------------------------------------------------
 
     void    ay_write_data(int data);
-    void    ay_tick();
-    void    ay_amp_adder(int& left, int& right);
-    void    ay_sound_tick(int t_states, int& audio_c);
+    void    ay_select(int data);
+    void    ay_reset();
+    void    ay_apply(AYChip& c, int reg_id, int data);
+    void    ay_tick(AYChip& c);
+    void    ay_env_step(AYChip& c, int envshape);
+    void    ay_env_steps(AYChip& c, int n);
+    void    ay_noise_steps(AYChip& c, int n);
+    void    ay_skip(AYChip& c, int n);
+    void    ay_steps(AYChip& c, int n, int tick);
+    int     ay_next_change(AYChip& c);
+    void    ay_advance(int t);
+    void    ay_sync(int t);
+    void    ay_init_tables();
+    void    ay_pan_init(int layout);
+    void    ay_emit(int t);
+    void    beep_edge(int bits);
+    void    beep_frame();
+    void    blip_init();
+    void    blip_add(int t, int dl, int dr);
+    int     audio_end_frame();
 
 // -----------------------------------------------------------------
 // Методы: Работа с видеобуфером
@@ -261,20 +605,87 @@ protected:
 // -----------------------------------------------------------------
 
     void    loadbin(const char* filename, int address);
-    void    loadtap(const char* filename);
     void    loadrom(const char* filename, int bank);
-    void    loadsna(const char* filename);
-    void    loadz80(const char* filename);
-    void    loadz80block(int mode, int& cursor, int &addr, unsigned char* data, int top, int rle);
-    void    savez80(const char* filename);
-    void    savesna(const char* filename);
-    void    encodebmp(int audio_c);
-    void    waveFmtHeader();
-    void    initTape();
-    // Для 6 бита возвращает состояние маг. входа
-    Uint8   getBitEar(); 
-    // чтение тап файла в память
-    int    tap2Mem(const char* filename, unsigned char* buf);   
+    int     file_detect(const unsigned char* p, int size);
+    static const char* load_message(int status);
+    int     load_file(const char* filename);
+    int     load_sna(const unsigned char* p, int size);
+    int     z80_unrle(const unsigned char* src, int n, unsigned char** pages, int top, int v1);
+    int     load_z80(const unsigned char* p, int size);
+    int     load_szx(const unsigned char* p, int size);
+    int     savesna(const char* filename);
+    void    snap_capture(SnapState& s);
+    int     z80_rle(const unsigned char* src, int n, unsigned char* dst);
+    void    save_z80(const SnapState& s, FILE* fp);
+    void    save_szx(const SnapState& s, FILE* fp);
+    int     snap_save(const SnapState& s, const char* filename);
+    int     save_snapshot(const char* filename);
+    void    snap_final();
+    void    snap_background(const char* filename);
+    void    snap_writer(SnapState* s, const char* filename);
+    void    encodebmp(int samples);
+    void    encodeframe(RecSlot* slot);
+    void    render_ram();
+    void    savebmp(const char* filename);
+    void    waveFmtHeader(int final);
+    void    wav_open(const char* filename);
+    void    wav_write(int n);
+    void    wav_close();
+    void    psg_open(const char* filename);
+    void    psg_put(int a, int b, int n);
+    void    psg_markers();
+    void    psg_write(int reg, int data);
+    void    psg_flush();
+    void    aev_open(const char* filename);
+    void    aev_put(int code, int data, int t);
+    void    aev_frame(int t);
+    void    aev_flush();
+    const unsigned char* map_file(const char* filename, int* size);
+    void    unmap_file(const unsigned char* data, int size);
+    unsigned int tape_get(int pos, int n);
+    void    tape_open();
+    int     tape_index(int n);
+    void    tape_data(TapeBlock& b, TapeData& d);
+    void    tape_add(int len, int count);
+    void    tape_flush();
+    void    tape_run(int len, int level);
+    void    tape_pulses(int len, int count);
+    void    tape_pause(int len);
+    int     tape_gen_data(TapeBlock& b);
+    int     tape_gen_direct(TapeBlock& b);
+    int     tape_gen_puls(TapeBlock& b);
+    int     tape_gen_pzx_data(TapeBlock& b);
+    void    tape_gen();
+    void    tape_fill();
+    void    tape_seek(int block);
+    int     tape_block_at();
+    void    tape_play();
+    void    tape_trap();
+    void    tape_turbo_check();
+    int     tape_edge_loop(int slots, int cycles, int& used);
+    int     tape_ear(long long t);
+    long long tape_next_edge();
+    void    save_open(const char* filename);
+    void    mic_take();
+    void    mic_edge(int level, long long clock);
+    void    mic_check();
+    void    mic_block();
+    int     mic_decode(unsigned char* data, int& size);
+    void    save_block(const unsigned char* data, int size);
+    void    save_direct();
+    void    save_trap();
+    void    save_close();
+
+// -----------------------------------------------------------------
+// Методы: Асинхронная запись
+// -----------------------------------------------------------------
+
+    void        rec_start();
+    void        rec_stop();
+    void        rec_writer();
+    RecSlot*    rec_get(int video);
+    void        rec_put(RecSlot* slot, FILE* fp);
+    void        rec_append(RecSlot* slot, const void* data, int size);
 
 // -----------------------------------------------------------------
 // Methods: Disassembler
@@ -301,6 +712,14 @@ protected:
     void            spi_write_data(unsigned char data);
     unsigned char   spi_read_data();
     void            spi_write_cmd(unsigned char data);
+    int             spi_open();
+    SpiLine*        spi_line(int lba);
+    void            spi_store(SpiLine& line);
+    void            spi_put_sector();
+    void            spi_flush();
+    void            spi_timer();
+    void            spi_csd(unsigned char* csd);
+    void            spi_abort();
 
 // -----------------------------------------------------------------
 // Методы: SDL-ориентированные
@@ -308,14 +727,30 @@ protected:
 
 #ifndef NO_SDL
     void    keyb(int press, SDL_KeyboardEvent* eventkey);
+    void    emu_loop();
+    void    pace_init();
+    void    pace_wait();
+    void    tb_publish();
+    int     tb_acquire();
+    int     ev_push(SDL_Event* ev);
+    int     ev_pop(SDL_Event* ev);
+    void    audio_open();
+    void    audio_close();
+    void    audio_push(const short* data, int n);
+    void    audio_drc(unsigned int fill);
 #endif
 
 public:
 
-    Z80Spectrum();
+    Z80Spectrum(int load_roms = 1);
     ~Z80Spectrum();
 
     void    args(int argc, char** argv);
+    void    shutdown();
     void    main();
+
+#ifndef NO_SDL
+    void    audio_callback(Uint8* stream, int len);
+#endif
 };
 
@@ -5,10 +5,15 @@
 #include "machine.cc"
 #include "constructor.cc"
 #include "video.cc"
+#include "record.cc"
+#include "wave.cc"
 #include "ay.cc"
 #include "io.cc"
 #include "snapshot.cc"
+#include "tape.cc"
+#include "tapesave.cc"
 #include "disasm.cc"
+#include "mapfile.cc"
 
 // Расширения
 #include "addon.spi.cc"
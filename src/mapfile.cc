@@ -0,0 +1,74 @@
+// -----------------------------------------------------------------
+// Файл, отображенный в память
+// -----------------------------------------------------------------
+
+// Файл только читается: страницы подгружает ОС по мере обращения, так что
+// многомегабайтный файл открывается сразу и не копируется в кучу.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// NULL - файла нет, он пуст или больше 2 Гб
+const unsigned char* Z80Spectrum::map_file(const char* filename, int* size) {
+
+    void* data = NULL;
+    *size = 0;
+
+#ifdef _WIN32
+
+    HANDLE fh = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fh == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER len;
+
+    if (GetFileSizeEx(fh, &len) && len.QuadPart > 0 && len.QuadPart < 0x7FFFFFFF) {
+
+        HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        // Вид держит отображение сам, описатели можно закрыть
+        if (mh) {
+
+            data = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mh);
+        }
+
+        if (data) *size = (int) len.QuadPart;
+    }
+
+    CloseHandle(fh);
+
+#else
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < 0x7FFFFFFF) {
+
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED) data = NULL;
+        else *size = (int) st.st_size;
+    }
+
+    close(fd);
+
+#endif
+
+    return (const unsigned char*) data;
+}
+
+void Z80Spectrum::unmap_file(const unsigned char* data, int size) {
+
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void*) data, size);
+#endif
+}
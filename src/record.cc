@@ -0,0 +1,164 @@
+// -----------------------------------------------------------------
+// Асинхронная запись видео и звука
+// -----------------------------------------------------------------
+
+// Эмуляция только копирует кадр в готовый буфер из пула и ставит его
+// в очередь, а fwrite выполняет отдельный поток. Оба кольца (свободные
+// буферы и очередь на запись) имеют по одному писателю; забрать элемент
+// из очереди могут оба потока (политика REC_DROP_OLDEST), поэтому хвост
+// очереди сдвигается через compare_exchange.
+
+// Выделение пула и запуск потока записи
+void Z80Spectrum::rec_start() {
+
+    if (rec_running) return;
+
+    if (rec_slots < 2) rec_slots = 2;
+
+    rec_pool  = (RecSlot*) malloc(rec_slots * sizeof(RecSlot));
+    rec_free  = (int*) malloc(rec_slots * sizeof(int));
+    rec_queue = (int*) malloc(rec_slots * sizeof(int));
+
+    for (int _i = 0; _i < rec_slots; _i++) {
+
+        rec_pool[_i].fp    = NULL;
+        rec_pool[_i].size  = 0;
+        rec_pool[_i].video = 0;
+        rec_pool[_i].data  = (unsigned char*) malloc(REC_SLOT_SIZE);
+        rec_free[_i] = _i;
+    }
+
+    rec_free_head = rec_slots;
+    rec_free_tail = 0;
+    rec_q_head    = 0;
+    rec_q_tail    = 0;
+    rec_running   = 1;
+    rec_thread    = std::thread(&Z80Spectrum::rec_writer, this);
+}
+
+// Дописать очередь до конца и остановить поток
+void Z80Spectrum::rec_stop() {
+
+    if (!rec_running) return;
+
+    rec_running = 0;
+    rec_cv.notify_all();
+    rec_thread.join();
+
+    fprintf(stderr, "Recorder: frames %u, dropped %u, stalls %u, max queue %u/%d\n",
+            rec_frames, rec_dropped, rec_stalls, rec_max_depth, rec_slots);
+
+    for (int _i = 0; _i < rec_slots; _i++) free(rec_pool[_i].data);
+    free(rec_pool);
+    free(rec_free);
+    free(rec_queue);
+    rec_pool = NULL;
+}
+
+// Поток записи
+void Z80Spectrum::rec_writer() {
+
+    while (1) {
+
+        unsigned int tail = rec_q_tail.load(std::memory_order_acquire);
+
+        // Очередь пуста: выйти или подождать
+        if (tail == rec_q_head.load(std::memory_order_acquire)) {
+
+            if (!rec_running) break;
+
+            std::unique_lock<std::mutex> lock(rec_mutex);
+            rec_cv.wait_for(lock, std::chrono::milliseconds(10));
+            continue;
+        }
+
+        int id = rec_queue[tail % rec_slots];
+
+        // Элемент мог забрать поток эмуляции (REC_DROP_OLDEST)
+        if (!rec_q_tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel))
+            continue;
+
+        RecSlot* slot = & rec_pool[id];
+        fwrite(slot->data, 1, slot->size, slot->fp);
+
+        // Вернуть буфер в пул
+        unsigned int head = rec_free_head.load(std::memory_order_relaxed);
+        rec_free[head % rec_slots] = id;
+        rec_free_head.store(head + 1, std::memory_order_release);
+        rec_cv.notify_all();
+    }
+
+    fflush(NULL);
+}
+
+// Взять свободный буфер; NULL - кадр выбрасывается по политике
+RecSlot* Z80Spectrum::rec_get(int video) {
+
+    rec_start();
+
+    while (1) {
+
+        unsigned int tail = rec_free_tail.load(std::memory_order_relaxed);
+        if (tail != rec_free_head.load(std::memory_order_acquire)) {
+
+            RecSlot* slot = & rec_pool[ rec_free[tail % rec_slots] ];
+            rec_free_tail.store(tail + 1, std::memory_order_release);
+
+            slot->size  = 0;
+            slot->video = video;
+            return slot;
+        }
+
+        // Пул исчерпан: поток записи не успевает
+        if (video && rec_policy == REC_DROP_DUP && diff_prev_frame == 0) {
+
+            rec_dropped++;
+            return NULL;
+        }
+
+        if (video && rec_policy == REC_DROP_OLDEST) {
+
+            unsigned int qt = rec_q_tail.load(std::memory_order_acquire);
+            if (qt != rec_q_head.load(std::memory_order_relaxed)) {
+
+                int id = rec_queue[qt % rec_slots];
+
+                // Звук не выбрасывается, ждать его записи
+                if (rec_pool[id].video && rec_q_tail.compare_exchange_strong(qt, qt + 1, std::memory_order_acq_rel)) {
+
+                    rec_dropped++;
+                    rec_pool[id].size = 0;
+                    return & rec_pool[id];
+                }
+            }
+        }
+
+        // REC_BLOCK: ждать освобождения буфера
+        rec_stalls++;
+        std::unique_lock<std::mutex> lock(rec_mutex);
+        rec_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+}
+
+// Поставить заполненный буфер в очередь
+void Z80Spectrum::rec_put(RecSlot* slot, FILE* fp) {
+
+    slot->fp = fp;
+
+    unsigned int head = rec_q_head.load(std::memory_order_relaxed);
+    rec_queue[head % rec_slots] = slot - rec_pool;
+    rec_q_head.store(head + 1, std::memory_order_release);
+
+    unsigned int depth = head + 1 - rec_q_tail.load(std::memory_order_relaxed);
+    if (depth > rec_max_depth) rec_max_depth = depth;
+    if (slot->video) rec_frames++;
+
+    rec_cv.notify_one();
+}
+
+// Дописать данные в буфер
+void Z80Spectrum::rec_append(RecSlot* slot, const void* data, int size) {
+
+    memcpy(slot->data + slot->size, data, size);
+    slot->size += size;
+}
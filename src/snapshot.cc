@@ -1,26 +1,4 @@
-// Раскидывает банки памяти для снапшота
-int Z80Spectrum::z80file_bankmap(int mode, int bank) {
-
-    // page0..7
-    if (mode == 3 || mode == 4) {
-        return bank - 3;
-    }
-    else if (mode == 0 || mode == 1) {
-
-        switch (bank) {
-
-            case 4: return 2; // 8000-bfff
-            case 5: return 0; // c000-ffff
-            case 8: return 5; // 4000-7fff
-            default:
-
-                printf("Z80 loader: can't recognize bank %d for hmode=%d ", bank, mode);
-                exit(1);
-        }
-    }
-
-    return 0;
-}
+#include <zlib.h>
 
 // Для нормальной загрузки 48k z80 снапшотов (mode=1)
 int Z80Spectrum::c48k_address(int address, int mode) {
@@ -61,7 +39,7 @@ void Z80Spectrum::loadbin(const char* filename, int address) {
 void Z80Spectrum::loadrom(const char* filename, int bank) {
 
     char fn[128];
-    printf ("fn=%s bank=%d \r\n", filename, bank);
+    fprintf(stderr, "fn=%s bank=%d \r\n", filename, bank);
     FILE* fp = fopen(filename, "rb");
     if (fp == NULL) {
 
@@ -81,552 +59,498 @@ void Z80Spectrum::loadrom(const char* filename, int bank) {
     fclose(fp);
 }
 
-// Загрузка снапшота
+// -----------------------------------------------------------------
+// Загрузка файла по содержимому
+// -----------------------------------------------------------------
+
+// Файл отображается в память и разбирается прямо из нее: формат узнается
+// по сигнатуре и размеру, а не по расширению, страницы Z80 и SZX
+// распаковываются сразу в банки memory. Каждое поле проверяется на выход
+// за конец файла; обрезанный или испорченный файл дает LOAD_BROKEN, а не
+// падение, поэтому загрузчик годится и для пакетного разбора снапшотов.
+//
 // https://worldofspectrum.org/faq/reference/z80format.htm
 // https://worldofspectrum.org/faq/reference/128kreference.htm
-void Z80Spectrum::loadz80(const char* filename) {
+// https://www.spectaculator.com/docs/zx-state/intro.shtml
+// http://speccy.info/SNA
 
-    char fn[128];
-    unsigned char data[128*1024];
+// Формат по содержимому. Сначала - то, что узнается однозначно (сигнатура,
+// цепочка блоков ровно до конца файла), потом по размеру; Z80 v1 без
+// метки конца - последним, так как у него нет ничего, кроме заголовка
+int Z80Spectrum::file_detect(const unsigned char* p, int size) {
 
-    FILE* fp = fopen(filename, "rb");
-    if (fp == NULL) {
+    if (size >= 8 && memcmp(p, "ZXTape!\x1A", 8) == 0) return FILE_TZX;
+    if (size >= 8 && memcmp(p, "PZXT", 4) == 0)        return FILE_PZX;
+    if (size >= 8 && memcmp(p, "ZXST", 4) == 0)        return FILE_SZX;
 
-        sprintf(fn, "/usr/local/share/vmzx/%s", filename);
-        fp = fopen(fn, "rb");
-        if (fp == NULL) {
-            printf("Can't load file %s\n", filename);
-            exit(1);
+    // TAP: блоки с длиной впереди
+    int pos = 0;
+    while (pos + 2 <= size && p[pos] + 256*p[pos + 1] >= 2) pos += 2 + p[pos] + 256*p[pos + 1];
+
+    if (pos == size && size > 0) return FILE_TAP;
+
+    // Z80 v2/v3: PC=0, длина доп. заголовка, страницы ровно до конца
+    int z80v2 = 0;
+
+    if (size >= 32 && (p[6] | p[7]) == 0) {
+
+        int len = p[30] + 256*p[31];
+        z80v2   = (len == 23 || len == 54 || len == 55);
+
+        for (pos = 32 + len; z80v2 && pos + 3 <= size; ) {
+
+            int data_size = p[pos] + 256*p[pos+1];
+            pos += 3 + (data_size == 0xffff ? 0x4000 : data_size);
         }
+
+        if (z80v2 && pos == size) return FILE_Z80;
     }
 
-    fseek(fp, 0, SEEK_END);
-    int fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    fread(data, 1, fsize, fp);
-    fclose(fp);
+    // Z80 v1 сжатый: метка 00 ED ED 00 в конце
+    if (size >= 34 && (p[6] | p[7]) && (p[12] & 0x20) && p[12] != 0xFF &&
+        memcmp(p + size - 4, "\x00\xED\xED\x00", 4) == 0) return FILE_Z80;
 
-    // Установка регистров
-    a  = data[0];
-    set_flags_register(data[1]);
-    c  = data[2];
-    b  = data[3];
-    l  = data[4];
-    h  = data[5];
-    pc = data[6] + 256*data[7];
-    sp = data[8] + 256*data[9];
-    i  = data[10];
-    r  = data[11];
-    e  = data[13];
-    d  = data[14];
-
-    c_prime = data[15];
-    b_prime = data[16];
-    e_prime = data[17];
-    d_prime = data[18];
-    l_prime = data[19];
-    h_prime = data[20];
-    a_prime = data[21];
-    set_flags_prime(data[22]);
-
-    iy      = data[23] + 256*data[24];
-    ix      = data[25] + 256*data[26];
-    iff1    = data[27] ? 1 : 0;
-    iff2    = data[28] ? 1 : 0;
-    imode   = data[29] & 3;
-
-    // старший бит R
-    r |= ((data[12] & 1) << 7);
-
-    // цвет бордюда
-    io_write(0xFE, (data[12] & 0x0E) >> 1);
-
-    int rle     = (data[12] & 0x20) == 0x20 ? 1 : 0;
-    int address = 0x4000;
-    int cursor  = 30;
-    int version = 1;
-
-    if (pc == 0) {
-
-        int _len   = data[30] + 256*data[31];
-        int _hmode = data[34];
-
-        pc        = data[32] + 256*data[33];
-        port_7ffd = data[35]; // 128k режим
-
-        io_write(0x7ffd, port_7ffd);
-
-        // AY данные
-        ay_register = data[38];
-        for (int _a = 0; _a < 16; _a++) ay_regs[_a] = data[39+_a];
-
-        if (_len == 23)      { cursor = 55; version = 2; }
-        else if (_len == 54) { cursor = 86; version = 3; }
-        else if (_len == 55) { cursor = 87; version = 3; }
-
-        if (version > 2) {
-
-            //sprintf(strbuf, "ZXCORE: Z80 file has %d version\n", version);
-            //fputs(strbuf, stderr);
-            //exit(1);
-        }
+    // SNA 48K; 128K - пять или шесть оставшихся банков
+    if (size == 49179 || size == 131103 || size == 147487) return FILE_SNA;
 
-        // Поддерживаемые режимы: 3,4(128k) 0,1(48k)
-        if (_hmode != 0 && _hmode != 1 && _hmode != 3 && _hmode != 4) {
+    // Экран: пиксели и атрибуты
+    if (size == 6912) return FILE_SCR;
 
-            sprintf(strbuf, "ZXCORE: Hardware mode is not 128k (mode=%d, pc=%x, cursor=%x)\n", _hmode, pc, cursor);
-            fputs(strbuf, stderr);
-            exit(1);
-        }
+    // Обрезанный Z80 узнается хотя бы по заголовку
+    if (z80v2 || (size >= 30 && (p[6] | p[7]))) return FILE_Z80;
 
-        // Для 48k будет всегда регистр памяти равен 10h
-        if (_hmode < 2) port_7ffd = 0x0010;
+    return FILE_UNKNOWN;
+}
 
-        // Следующий блок
-        while (cursor < fsize) {
+// Текст результата load_file
+const char* Z80Spectrum::load_message(int status) {
 
-            int data_size = data[cursor] + data[cursor+1]*256;
+    switch (status) {
 
-            // Для 128k данные в [3..11]
-            int data_bank = z80file_bankmap(_hmode, data[cursor + 2]);
+        case LOAD_OK:           return "ok";
+        case LOAD_NO_FILE:      return "no file";
+        case LOAD_UNKNOWN:      return "unknown format";
+        case LOAD_BROKEN:       return "truncated or corrupted";
+        case LOAD_UNSUPPORTED:  return "unsupported machine";
+    }
 
-            // Переход к данным
-            cursor += 3;
+    return "error";
+}
 
-            // Не скомпрессированные данные
-            if (data_size == 0xffff) { rle = 0; data_size = 0x4000; } else rle = 1;
+// Загрузка снапшота, ленты или экрана; LOAD_OK или код ошибки
+int Z80Spectrum::load_file(const char* filename) {
 
-            // Вычислить следующий адрес
-            address = (data_bank) * 0x4000;
+    char fn[256];
+    int  size;
 
-            // Явно указать окончание данных
-            int next = cursor + data_size;
-            if (next > fsize) next = fsize;
+    const unsigned char* p = map_file(filename, &size);
 
-            // Загрузка блока
-            loadz80block(0, cursor, address, data, cursor + data_size, rle);
-        }
+    // Снапшоты из комплекта (48k.z80) лежат рядом с ПЗУ
+    if (p == NULL) {
+
+        snprintf(fn, sizeof(fn), "/usr/local/share/vmzx/%s", filename);
+        p = map_file(fn, &size);
     }
-    // Обычная загрузка блока 48к (v1)
-    else {
 
-        port_7ffd = 0x30;
-        loadz80block(1, cursor, address, data, fsize, rle);
+    if (p == NULL) return LOAD_NO_FILE;
+
+    int type   = file_detect(p, size);
+    int status = LOAD_UNKNOWN;
+
+    switch (type) {
+
+        // Лента остается отображенной: блоки разбирает tape.cc по мере игры
+        case FILE_TAP:
+        case FILE_TZX:
+        case FILE_PZX:
+
+            if (tapfile) unmap_file(tapfile, tapsize);
+
+            tapfile = p;
+            tapsize = size;
+
+            printf("loading tape file: %s\n", filename);
+            tape_open();
+            return LOAD_OK;
+
+        case FILE_SNA: status = load_sna(p, size); break;
+        case FILE_Z80: status = load_z80(p, size); break;
+        case FILE_SZX: status = load_szx(p, size); break;
+
+        // Экран - в банк 5, программа не меняется
+        case FILE_SCR:
+
+            memcpy(memory + 5*0x4000, p, 6912);
+            status = LOAD_OK;
+            break;
     }
+
+    unmap_file(p, size);
+    return status;
 }
 
-// Загрузка блока в память
-void Z80Spectrum::loadz80block(int mode, int& cursor, int &addr, unsigned char* data, int top, int rle) {
+// SNA 48K и 128K
+int Z80Spectrum::load_sna(const unsigned char* p, int size) {
 
-    if (rle) {
+    // Базовые параметры
+    i = p[0];
+    r = p[20];
 
-        while (cursor < top) {
+    l_prime = p[1]; l = p[9];
+    h_prime = p[2]; h = p[10];
+    e_prime = p[3]; e = p[11];
+    d_prime = p[4]; d = p[12];
+    c_prime = p[5]; c = p[13];
+    b_prime = p[6]; b = p[14];
+    set_flags_prime(p[7]);
+    a_prime = p[8];
 
-            // EOF
-            if (data[cursor]   == 0x00 &&
-                data[cursor+1] == 0xED &&
-                data[cursor+2] == 0xED &&
-                data[cursor+3] == 0x00) {
-                break;
-            }
+    iy = p[15] + p[16]*256;
+    ix = p[17] + p[18]*256;
+    sp = p[23] + p[24]*256;
 
-            // Процедура декомпрессии
-            if (data[cursor]   == 0xED &&
-                data[cursor+1] == 0xED) {
+    iff1 = !!(p[19] & 4);
+    iff2 = !!(p[19] & 4);
 
-                for (int t_ = 0; t_ < data[cursor+2]; t_++) {
+    set_flags_register(p[21]);
+    a = p[22];
 
-                    memory[c48k_address(addr, mode)] = data[cursor+3];
-                    addr++;
-                }
+    imode     = p[25] & 3;
+    border_id = p[26] & 7;
 
-                cursor += 4;
+    // 48k: PC на стеке
+    if (size == 49179) {
 
-            } else {
+        port_7ffd = 0x30;
 
-                memory[c48k_address(addr, mode)] = data[cursor];
+        memcpy(memory + 5*0x4000, p + 27,         0x4000);
+        memcpy(memory + 2*0x4000, p + 27+0x4000,  0x4000);
+        memcpy(memory + 0*0x4000, p + 27+0x8000,  0x4000);
 
-                addr++;
-                cursor++;
-            }
-        }
+        pc = pop_word();
+        return LOAD_OK;
+    }
 
-    } else {
+    // 128k: после 48K - PC, 7FFD, TR-DOS и остальные банки по порядку;
+    // включенный банк 2 или 5 записан дважды - тогда банков шесть
+    int sel_bank = p[49181] & 7;
+    int rest     = (sel_bank == 2 || sel_bank == 5) ? 6 : 5;
 
-        while (cursor < top) {
+    if (size != 49183 + rest*0x4000) return LOAD_BROKEN;
 
-            memory[c48k_address(addr, mode)] = data[cursor];
-            addr++;
-            cursor++;
-        }
+    pc          = p[49179] + 256*p[49180];
+    port_7ffd   = p[49181];
+    trdos_latch = !!p[49182];
+
+    memcpy(memory + 5*0x4000,        p + 27,        0x4000);
+    memcpy(memory + 2*0x4000,        p + 16411,     0x4000);
+    memcpy(memory + sel_bank*0x4000, p + 32795,     0x4000);
+
+    const unsigned char* next = p + 49183;
+
+    for (int n = 0; n < 8; n++) {
+
+        if (n == 2 || n == 5 || n == sel_bank) continue;
+
+        memcpy(memory + n*0x4000, next, 0x4000);
+        next += 0x4000;
     }
-}
 
-void Z80Spectrum::initTape(){
-    st_tape = 0;
-    pos_tape = 0;
+    return LOAD_OK;
 }
 
-int Z80Spectrum::tap2Mem(const char* filename, unsigned char* buf) {    
-    FILE* fp = fopen(filename, "rb");
-    if (fp == NULL) { printf("No file %s\n", filename); exit(1); }
-    fseek(fp, 0, SEEK_END);
-    int fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    fread(buf, 1, fsize, fp);
-    fclose(fp);
-    return fsize;
-}
+// Распаковка RLE Z80 (ED ED n b - n байт b) сразу в банки: pages - банки
+// по 16К подряд, top - сколько байт поместится. v1 - блок до метки
+// 00 ED ED 00. Возвращает число байт или -1, если данные не помещаются
+int Z80Spectrum::z80_unrle(const unsigned char* src, int n, unsigned char** pages, int top, int v1) {
 
-inline int getBit(unsigned char data, int bitn ){
-    int result = (data>>bitn) & 1;
-    //printf("d: %x b:%d r:%d\n", data, bitn, result);
-    return result;
-}
+    int out = 0;
 
-int delayTick(long t_states_all, int delay){
-    static long t_ear=0;
-    if (t_ear + delay < t_states_all ) {
-        t_ear = t_states_all;
-        return 1;
-    } else
-        return 0;
-}
+    for (int k = 0; k < n; ) {
+
+        if (v1 && k + 4 <= n && src[k] == 0x00 && src[k+1] == 0xED && src[k+2] == 0xED && src[k+3] == 0x00) break;
+
+        int count = 1, data = src[k];
 
-int checkDelayAndInverse(long t_states_all, int state, Uint8 &bit){    
-    static int pulse_cnt=0;
-    int delays[]={4334/2, 667, 737, 1710, 1710, 855, 855 };  
-    int pulses[]={2*2*807, 1,   1,   1,    1,    1,  1 };
-
-    if (delayTick(t_states_all, delays[state])) {        
-        if (bit) bit=0; else bit=1;
-        pulse_cnt++;                
-        if (pulse_cnt == pulses[state]) {
-            pulse_cnt=0; 
-            return 1;
+        if (k + 4 <= n && src[k] == 0xED && src[k+1] == 0xED) {
+
+            count = src[k+2];
+            data  = src[k+3];
+            k += 4;
         }
+        else k++;
+
+        if (out + count > top) return -1;
+
+        for (; count > 0; count--, out++) pages[out >> 14][out & 0x3fff] = data;
     }
-    return 0;
+
+    return out;
 }
 
-//6 бит магнитофона
-Uint8 Z80Spectrum::getBitEar(){
-    static Uint8 ear=0;
-    static int bitn=0; // номер бита
-    static int len_block=0; // длина текущего блока
-    static int cnt_block=0; //  в текущем блоке
-    static int data=0;
-    switch (st_tape) {
-        case 0: // pilot tone
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=1;
-                cnt_block=0;
-                len_block = tapfile[pos_tape++] + tapfile[pos_tape++]*256;                
-                printf("len block: %d pos: %d\n", len_block, pos_tape);
-            }
-            break;
-        case 1: // header 0
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=2;
-                //printf("2 ear: %d\n", ear);
-            }
-            break;
-        case 2: // header 1
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=7;
-            }
-            break;
-        case 3: // 1.0
-            ear =0;
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=4;
-                //printf("3 ear: %d\n", ear);
-            }
-            break;
-        case 4: // 1.1
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=8;
-                //printf("3 ear: %d\n", ear);
-            }
-            break;
-        case 5: // 0.0
-            ear = 0;
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=6;
-                //printf("3 ear: %d\n", ear);
-            }
-            break;
-        case 6: // 0.1
-            if (checkDelayAndInverse(t_states_all, st_tape, ear) ) {
-                st_tape=8;
-                //printf("3 ear: %d\n", ear);
-            }
-            break;
-        case 7: // начало передачи байта
-            bitn = 7;            
-            //printf("7s cnt:%d\n", cnt_block);
-            if (cnt_block++ >= len_block) 
-                st_tape = 9; //следующий блок
-            else {
-                data = tapfile[pos_tape++];
-                st_tape = 8;
-            }
-            break;
-        case 8: // следующий бит
-            if (bitn < 0) st_tape=7 ;
-            else {
-                if (getBit(data, bitn--))
-                    st_tape=3;
-                else st_tape=5;
-            }
-            break;
-        case 9: // следующий блок
-            if (pos_tape >= tapsize) st_tape=15;
-            if (delayTick(t_states_all, 1750000)) {
-                st_tape=0 ;
-                //printf("10s :%d\n", st_tape);
-            }
-            break;
-        default:
-            start_tape=0;
-            st_tape=0;
-            pos_tape=0;
-            break;
+// Z80 v1, v2, v3
+int Z80Spectrum::load_z80(const unsigned char* p, int size) {
+
+    int cursor = 30, hmode = 0, is128 = 0;
+    int flags12 = p[12] == 0xFF ? 1 : p[12];
+
+    // v2/v3: дополнительный заголовок и тип машины
+    if ((p[6] | p[7]) == 0) {
+
+        int len     = p[30] + 256*p[31];
+        int version = len == 23 ? 2 : 3;
+
+        cursor = 32 + len;
+        if (cursor > size) return LOAD_BROKEN;
+
+        hmode = p[34];
+
+        // v2: 3,4 - 128k; v3: 4..6 - 128k, 3 - 48k+MGT; Pentagon и +2 - как 128k
+        if (version == 2) is128 = (hmode == 3 || hmode == 4);
+        else              is128 = (hmode >= 4 && hmode <= 6) || hmode == 9 || hmode == 12;
+
+        int is48 = hmode <= 1 || (version == 3 && hmode == 3);
+
+        if (!is128 && !is48) return LOAD_UNSUPPORTED;
+
+        // Блоки страниц проверяются до записи в память
+        for (int pos = cursor; pos < size; ) {
+
+            if (pos + 3 > size) return LOAD_BROKEN;
+
+            int data_size = p[pos] + 256*p[pos+1];
+            pos += 3 + (data_size == 0xffff ? 0x4000 : data_size);
+
+            if (pos > size) return LOAD_BROKEN;
+        }
     }
-    return ear;
-}
+    // v1 - всегда 48k
+    else if (flags12 & 0x20) {
+        // Длина сжатых данных проверяется при распаковке
+    }
+    else if (size < 30 + 0xC000) return LOAD_BROKEN;
+
+    // Установка регистров
+    a  = p[0];
+    set_flags_register(p[1]);
+    c  = p[2];
+    b  = p[3];
+    l  = p[4];
+    h  = p[5];
+    pc = p[6] + 256*p[7];
+    sp = p[8] + 256*p[9];
+    i  = p[10];
+    r  = (p[11] & 0x7f) | ((flags12 & 1) << 7);
+    e  = p[13];
+    d  = p[14];
+
+    c_prime = p[15];
+    b_prime = p[16];
+    e_prime = p[17];
+    d_prime = p[18];
+    l_prime = p[19];
+    h_prime = p[20];
+    a_prime = p[21];
+    set_flags_prime(p[22]);
+
+    iy      = p[23] + 256*p[24];
+    ix      = p[25] + 256*p[26];
+    iff1    = p[27] ? 1 : 0;
+    iff2    = p[28] ? 1 : 0;
+    imode   = p[29] & 3;
+
+    // цвет бордюра
+    io_write(0xFE, (flags12 & 0x0E) >> 1);
+
+    // v1: 48K одним блоком с 4000h
+    if (cursor == 30) {
+
+        unsigned char* pages[3] = { memory + 5*0x4000, memory + 2*0x4000, memory };
+
+        port_7ffd = 0x30;
 
-// https://sinclair.wiki.zxnet.co.uk/wiki/TAP_format
-void Z80Spectrum::loadtap(const char* filename) {    
-
-    tapsize = tap2Mem(filename, tapfile);
-    printf("loading tape file: %s\n", filename);
-        
-    int nblock=0;
-    int szblock=0;
-    int flag;    
-    int theader=0;
-
-    char file[11]="";
-    int szheader=0;
-    int p1,p2,p3;
-    for (int i=0;i<tapsize; ) {
-        nblock++;
-        szblock = tapfile[i] + tapfile[i+1]*256 ; // (17 bytes+flag+checksum)
-        flag = tapfile[i+2];   // (A reg, 00 for headers, ff for data blocks)  
-        if (flag) { // data block
-            theader=0;
-            szheader= 0;
-            p1 = p2 = 0;
-        } else {  // header
-            theader = tapfile[i+3]; //first byte (0,1,2 or 3  Program, Number array, Character array or Code file)
-            strncpy(file, (char*)tapfile+3+1+i, 10); file[10]=0;
-            szheader= tapfile[3+11+i] + tapfile[3+11+i+1]*256 ;
-            //Program file, p1 holds the autostart line number (or a number >=32768 ) 
-            //    and parameter 2 holds the start of the variable area relative to the start of the program.
-            //Code file, p1 holds the start of the code block when saved, and parameter 2 holds 32768.
-            //Data files finally, the byte at position 14 decimal holds the variable name.
-            p1 = tapfile[3+13+i]+ tapfile[3+13+i+1]*256 ;
-            p2 = tapfile[3+15+i]+ tapfile[3+15+i+1]*256 ;
-        }               
-        printf("block: %d(%x)\t block sz: %d\t flag: %d\t type: %d\t file: %s\t hdr sz: %d \t p1: %d\t p2: %d \n", 
-                nblock, i,   szblock,           flag,    theader,   file,       szheader,     p1,     p2  );
-        i += (2+szblock); 
+        if (flags12 & 0x20) return z80_unrle(p + 30, size - 30, pages, 0xC000, 1) == 0xC000 ? LOAD_OK : LOAD_BROKEN;
+
+        for (int n = 0; n < 3; n++) memcpy(pages[n], p + 30 + n*0x4000, 0x4000);
+        return LOAD_OK;
     }
-    return;
-    // Первым в TAP должен идти бейсик
-    if (tapfile[0x17] != 0xFF) {
-        printf("No BASIC program\n"); exit(1);
+
+    pc = p[32] + 256*p[33];
+
+    // 48k - ПЗУ 48K и блокировка 7FFD, как у v1, SNA и SZX
+    port_7ffd = is128 ? p[35] : 0x30;
+
+    // AY данные
+    if (is128 || (p[37] & 4)) {
+
+        ay_sel      = 0;
+        ay_register = p[38] & 15;
+        for (int _a = 0; _a < 16; _a++) ay_apply(ay[0], _a, p[39+_a]);
     }
 
-    // Размер бейсик-программы
-    int bsize = tapfile[0x15] + tapfile[0x16]*256 - 2;
+    int status = LOAD_OK;
+
+    // Страницы: 128k - 3..10 -> банки 0..7, 48k - 4, 5, 8 -> 2, 0, 5.
+    // ПЗУ и прочие страницы пропускаются
+    for (int pos = cursor; pos < size; ) {
 
-    // Запись в программную область
-    for (int q = 0; q < bsize; q++) memory[c48k_address(0x5ccb+q, 1)] = tapfile[0x18 + q];
+        int data_size = p[pos] + 256*p[pos+1];
+        int page      = p[pos+2];
+        int bank      = -1;
 
-    int endp = 0x5ccb + bsize;
-    int next = endp;
-    printf("basic size: %d", bsize);
-    // END OF PROGRAM: 
-    put48mem_word(endp,   0x0D80);  // Линия 1
-    put48mem_word(endp+2, 0x2280);
-    put48mem_word(endp+4, 0x800D);  // Линия 2
-    put48mem_word(0x5C4B, next);    // VARS :: https://skoolkid.github.io/rom/asm/5C4B.html
-    next++;
+        pos += 3;
 
-    put48mem_word(0x5C59, next);    // E-LINE :: https://skoolkid.github.io/rom/asm/5C59.html
-    put48mem_word(0x5C5B, next);    // K-CUR :: https://skoolkid.github.io/rom/asm/5C5B.html
+        if (is128) { if (page >= 3 && page <= 10) bank = page - 3; }
+        else if (page == 4) bank = 2;
+        else if (page == 5) bank = 0;
+        else if (page == 8) bank = 5;
 
-    next+=2;
-    put48mem_word(0x5C61, next);    // WORKSP :: https://skoolkid.github.io/rom/asm/5C61.html
-    put48mem_word(0x5C63, next);    // STKBOT :: https://skoolkid.github.io/rom/asm/5C63.html
-    put48mem_word(0x5C65, next);    // STKEND :: https://skoolkid.github.io/rom/asm/5C65.html
+        unsigned char* dst = bank >= 0 ? memory + bank*0x4000 : NULL;
 
-    next++;
-    put48mem_word(0x5C5D, next);    // CH-ADD :: https://skoolkid.github.io/rom/asm/5C5D.html
+        // Не сжатые данные
+        if (data_size == 0xffff) {
 
-    next++;
-    put48mem_word(0x5C55, next);    // NXTLIN :: https://skoolkid.github.io/rom/asm/5C55.html
+            if (dst) memcpy(dst, p + pos, 0x4000);
+            data_size = 0x4000;
+        }
+        else if (dst && z80_unrle(p + pos, data_size, &dst, 0x4000, 0) != 0x4000) {
+            status = LOAD_BROKEN;
+        }
 
-    for (int a=0; a<8412;a++) {
-        put48mem_byte(a+28672, tapfile[185+a]);
+        pos += data_size;
     }
 
-/*
-    // Всякие непонятные параметры
-    put48mem_byte(0x5C3B, 0x84);
-    put48mem_byte(0x5C5F, 0xF8);
-    put48mem_byte(0x5C67, 0x1B); //  CALC B reg
-    *
-    put48mem_word(0x5C44, 0xFEFF);
-    put48mem_word(0x5C46, 0x01FF);
-    put48mem_word(0x5C74, 0x1A01);
-*/
+    return status;
 }
 
-// Сохранение снапшота в файл (не RLE) 48k
-void Z80Spectrum::savez80(const char* filename) {
+// SZX (zx-state): заголовок ZXST и блоки ID + длина; нужны Z80R, SPCR,
+// RAMP, AY и свой AYTS. Страницы RAMP обычно сжаты zlib
+int Z80Spectrum::load_szx(const unsigned char* p, int size) {
 
-    unsigned char data[48*1024];
+    int machine = p[6];
+    int is128;
 
-    FILE* fp = fopen(filename, "wb+");
+    // 48K, NTSC 48K; 128K, +2, Pentagon 128
+    if      (machine == 1 || machine == 15) is128 = 0;
+    else if (machine == 2 || machine == 3 || machine == 7) is128 = 1;
+    else return LOAD_UNSUPPORTED;
 
-    // Установка регистров
-    data[0] = a;
-    data[1] = get_flags_register();
-    data[2] = c;
-    data[3] = b;
-    data[4] = l;
-    data[5] = h;
-    data[6] = pc & 0xff;
-    data[7] = (pc >> 8) & 0xff;
-    data[8] = sp & 0xff;
-    data[9] = (sp >> 8) & 0xff;
-    data[10] = i;
-    data[11] = (r & 0x7f);
-    data[12] = (r >> 7) | ((border_id&7)<<1) | 0x00; // старший бит R, RLE=0
-    data[13] = e;
-    data[14] = d;
-    data[15] = c_prime;
-    data[16] = b_prime;
-    data[17] = e_prime;
-    data[18] = d_prime;
-    data[19] = l_prime;
-    data[20] = h_prime;
-    data[21] = a_prime;
-    data[22] = get_flags_prime();
-
-    data[23] = iy & 0xff;
-    data[24] = (iy >> 8) & 0xff;
-
-    data[25] = ix & 0xff;
-    data[26] = (ix >> 8) & 0xff;
-
-    data[27] = iff1 ? 1 : 0;
-    data[28] = iff2 ? 1 : 0;
-    data[29] = imode;
-
-    fwrite(data, 1, 30, fp);
-
-    // Преобразовать память
-    for (int _a = 0x4000; _a < 0x10000; _a++)
-        data[_a - 0x4000] = memory[c48k_address(_a, 1)];
-
-    fwrite(data, 1, 0xc000, fp);
-    fclose(fp);
-}
+    // Блоки проверяются до записи в машину
+    const unsigned char* regs = NULL;
 
-// Загрука файла снапшота
-// http://speccy.info/SNA
-void Z80Spectrum::loadsna(const char* filename) {
+    for (int pos = 8; pos < size; ) {
 
-    unsigned char data[192*1024];
+        if (size - pos < 8) return LOAD_BROKEN;
 
-    FILE* fp = fopen(filename, "rb");
-    if (fp == NULL) { printf("Can't load file %s\n", filename); exit(1); }
-    fseek(fp, 0, SEEK_END);
-    int fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    fread(data, 1, fsize, fp);
-    fclose(fp);
+        unsigned int len = p[pos+4] | (p[pos+5] << 8) | (p[pos+6] << 16) | ((unsigned int) p[pos+7] << 24);
+        if (len > (unsigned int)(size - pos - 8)) return LOAD_BROKEN;
 
-    // Базовые параметры
-    i = data[0];
-    r = data[20];
+        if (memcmp(p + pos, "Z80R", 4) == 0) {
+
+            if (len < 37) return LOAD_BROKEN;
+            regs = p + pos + 8;
+        }
 
-    l_prime = data[1]; l = data[9];
-    h_prime = data[2]; h = data[10];
-    e_prime = data[3]; e = data[11];
-    d_prime = data[4]; d = data[12];
-    c_prime = data[5]; c = data[13];
-    b_prime = data[6]; b = data[14];
-    set_flags_prime(data[7]);
-    a_prime = data[8];
+        pos += 8 + len;
+    }
 
-    iy = data[15] + data[16]*256;
-    ix = data[17] + data[18]*256;
-    sp = data[23] + data[24]*256;
+    if (regs == NULL) return LOAD_BROKEN;
 
-    iff1 = !!(data[19] & 4);
-    iff2 = !!(data[19] & 4);
+    // Регистры: пары младшим байтом вперед, F раньше A
+    set_flags_register(regs[0]); a = regs[1];
+    c = regs[2];  b = regs[3];
+    e = regs[4];  d = regs[5];
+    l = regs[6];  h = regs[7];
+    set_flags_prime(regs[8]); a_prime = regs[9];
+    c_prime = regs[10]; b_prime = regs[11];
+    e_prime = regs[12]; d_prime = regs[13];
+    l_prime = regs[14]; h_prime = regs[15];
 
-    set_flags_register(data[21]);
-    a = data[22];
+    ix    = regs[16] + 256*regs[17];
+    iy    = regs[18] + 256*regs[19];
+    sp    = regs[20] + 256*regs[21];
+    pc    = regs[22] + 256*regs[23];
+    i     = regs[24];
+    r     = regs[25];
+    iff1  = regs[26] ? 1 : 0;
+    iff2  = regs[27] ? 1 : 0;
+    imode = regs[28] & 3;
 
-    imode     = data[25] & 3;
-    border_id = data[26] & 7;
+    // chFlags: бит 1 - процессор на HALT
+    halted = (regs[34] & 2) ? 1 : 0;
 
-    // 48k
-    if (fsize == 49179) {
+    port_7ffd = is128 ? 0 : 0x30;
 
-        for (int w = 0; w < 49152; w++)
-            memory[ c48k_address(0x4000 + w, 1) ] = data[27 + w];
+    int status = LOAD_OK;
 
-        pc = pop_word();
-    }
-    // 128k
-    else if (fsize == 131103) {
+    for (int pos = 8; pos < size; ) {
 
-        pc = data[49179] + 256*data[49180];
+        const unsigned char* q = p + pos + 8;
+        int len = q[-4] | (q[-3] << 8) | (q[-2] << 16) | (q[-1] << 24);
 
-        port_7ffd   =   data[49181];
-        trdos_latch = !!data[49182];
+        pos += 8 + len;
 
-        io_write(0x7ffd, port_7ffd);
+        // Бордюр и 7FFD
+        if (memcmp(q - 8, "SPCR", 4) == 0 && len >= 8) {
 
-        int sel_bank = port_7ffd & 7;
+            io_write(0xFE, q[0] & 7);
+            if (is128) port_7ffd = q[1];
+        }
+        // AY: флаги, текущий регистр, 16 регистров
+        else if (memcmp(q - 8, "AY\0\0", 4) == 0 && len >= 18) {
+
+            ay_sel      = 0;
+            ay_register = q[1] & 15;
+            for (int _a = 0; _a < 16; _a++) ay_apply(ay[0], _a, q[2+_a]);
+        }
+        // Второй чип TurboSound (пишет save_szx): выбранный чип, регистр,
+        // 16 регистров. Идет после AY
+        else if (memcmp(q - 8, "AYTS", 4) == 0 && len >= 18) {
+
+            for (int _a = 0; _a < 16; _a++) ay_apply(ay[1], _a, q[2+_a]);
+            ay_chips = 2;
 
-        for (int w = 0; w < 16384; w++) {
+            if (q[0] == 1) {
 
-            memory[5*0x4000 + w] = data[27 + w];
-            memory[2*0x4000 + w] = data[16411 + w];
-            memory[sel_bank*0x4000 + w] = data[32795 + w];
+                ay[0].latch = ay_register;
+                ay_sel      = 1;
+                ay_register = q[1] & 15;
+            }
+            else ay[1].latch = q[1] & 15;
         }
+        // Страница: флаги (бит 0 - zlib), номер, данные
+        else if (memcmp(q - 8, "RAMP", 4) == 0 && len >= 3) {
 
-        int _start = 49183;
-        for (int n = 0; n < 8; n++) {
+            int page = q[2];
 
-            if (n == 2 || n == 5 || n == sel_bank)
-                continue;
+            if (page > 7 || (!is128 && page != 0 && page != 2 && page != 5)) continue;
+
+            unsigned char* bank = memory + page*0x4000;
 
-            for (int w = 0; w < 16384; w++)
-                memory[n*0x4000 + w] = data[_start++];
+            if (q[0] & 1) {
+
+                uLongf out = 0x4000;
+                if (uncompress(bank, &out, q + 3, len - 3) != Z_OK || out != 0x4000) status = LOAD_BROKEN;
+            }
+            else if (len - 3 == 0x4000) memcpy(bank, q + 3, 0x4000);
+            else status = LOAD_BROKEN;
         }
     }
-    else if (fsize == 147487) {
-        printf("Snapshot 128k+ currently not supported\n");
-    }
-    else {
-        printf("Error snapshot size %d\n", fsize);
-        exit(1);
-    }
+
+    return status;
 }
 
-// Сохранение 128к снапшота
-void Z80Spectrum::savesna(const char* filename) {
+// Сохранение снапшота SNA. Машина в режиме 48K (7FFD закрыт на ПЗУ 48K,
+// банк 0, TR-DOS выключен) - 48K SNA, PC на стеке; иначе 128K SNA:
+// включенный банк 2 или 5 пишется дважды, тогда банков шесть
+int Z80Spectrum::savesna(const char* filename) {
 
-    unsigned char data[131103];
+    int sel_bank = port_7ffd & 7;
+    int is48     = (port_7ffd & 0x3F) == 0x30 && !trdos_latch;
+    int rest     = (sel_bank == 2 || sel_bank == 5) ? 6 : 5;
+    int size     = is48 ? 49179 : 49183 + rest*0x4000;
+
+    unsigned char* data = (unsigned char*) malloc(size);
 
     // Базовые параметры
     data[0] = i;
@@ -643,7 +567,8 @@ void Z80Spectrum::savesna(const char* filename) {
     data[17] = ix & 0xff; data[18] = (ix>>8) & 0xff;
     data[23] = sp & 0xff; data[24] = (sp>>8) & 0xff;
 
-    data[19] = (iff1&1) | ((iff2&1)<<1);
+    // Бит 2 - IFF2
+    data[19] = iff2 ? 4 : 0;
     data[20] = r;
     data[21] = get_flags_register();
     data[22] = a;
@@ -651,12 +576,6 @@ void Z80Spectrum::savesna(const char* filename) {
     data[25] = imode & 3;
     data[26] = border_id & 7;
 
-    data[49179] = pc & 0xff;
-    data[49180] = (pc>>8) & 0xff;
-    data[49181] = port_7ffd;
-    data[49182] = !!trdos_latch;
-
-    int sel_bank = port_7ffd & 7;
     for (int w = 0; w < 16384; w++) {
 
         data[27    + w] = memory[5*0x4000 + w];
@@ -664,19 +583,356 @@ void Z80Spectrum::savesna(const char* filename) {
         data[32795 + w] = memory[sel_bank*0x4000 + w];
     }
 
-    int _start = 49183;
-    for (int n = 0; n < 8; n++) {
+    if (is48) {
+
+        // PC - на стек в образе памяти; стек в ПЗУ не записать
+        int s = (sp - 2) & 0xffff;
+
+        for (int _k = 0; _k < 2; _k++) {
+
+            int addr = (s + _k) & 0xffff;
+            if (addr >= 0x4000) data[27 + addr - 0x4000] = (pc >> (8*_k)) & 0xff;
+        }
+
+        data[23] = s & 0xff; data[24] = (s>>8) & 0xff;
+    }
+    else {
+
+        data[49179] = pc & 0xff;
+        data[49180] = (pc>>8) & 0xff;
+        data[49181] = port_7ffd;
+        data[49182] = !!trdos_latch;
+
+        int _start = 49183;
+        for (int n = 0; n < 8; n++) {
 
-        if (n == 2 || n == 5 || n == sel_bank)
-            continue;
+            if (n == 2 || n == 5 || n == sel_bank)
+                continue;
 
-        for (int w = 0; w < 16384; w++) {
-            data[_start++] = memory[n*0x4000 + w];
+            for (int w = 0; w < 16384; w++) {
+                data[_start++] = memory[n*0x4000 + w];
+            }
         }
     }
 
-    FILE* fp = fopen(filename, "w+");
-    if (fp == NULL) { printf("Can't write file %s\n", filename); exit(1); }
-    fwrite(data, 1, 131103, fp);
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) { printf("Can't write file %s\n", filename); free(data); return 0; }
+    fwrite(data, 1, size, fp);
     fclose(fp);
+
+    free(data);
+    return 1;
+}
+
+// -----------------------------------------------------------------
+// Запись снапшотов Z80 и SZX
+// -----------------------------------------------------------------
+
+// Состояние снимается целиком (регистры, 7FFD, оба AY, все 128К) в SnapState
+// между кадрами; сжатие и запись идут уже по снимку, поэтому в GUI они
+// уходят в отдельный поток и эмуляция не ждет zlib и диск.
+// Машина считается 48K, если 7FFD заблокирован на ПЗУ 48K и банке 0.
+
+// Снимок машины
+void Z80Spectrum::snap_capture(SnapState& s) {
+
+    s.a  = a;  s.f  = get_flags_register();
+    s.b  = b;  s.c  = c;
+    s.d  = d;  s.e  = e;
+    s.h  = h;  s.l  = l;
+    s.a_ = a_prime; s.f_ = get_flags_prime();
+    s.b_ = b_prime; s.c_ = c_prime;
+    s.d_ = d_prime; s.e_ = e_prime;
+    s.h_ = h_prime; s.l_ = l_prime;
+
+    s.ix = ix;  s.iy = iy;
+    s.sp = sp;  s.pc = pc;
+    s.i  = i;   s.r  = r;
+
+    s.iff1   = iff1;
+    s.iff2   = iff2;
+    s.imode  = imode;
+    s.halted = halted;
+
+    s.border    = border_id & 7;
+    s.port_fe   = port_fe;
+    s.port_7ffd = port_7ffd;
+    s.is128     = (port_7ffd & 0x37) != 0x30;
+
+    // TurboSound: у невыбранного чипа регистр адреса хранится в latch
+    s.ay_sel   = ay_sel;
+    s.ay_chips = ay_chips;
+
+    for (int _c = 0; _c < 2; _c++) {
+
+        s.ay_cur[_c] = (_c == ay_sel ? ay_register : ay[_c].latch) & 15;
+        for (int _a = 0; _a < 16; _a++) s.ay_regs[_c][_a] = ay[_c].regs[_a];
+    }
+
+    memcpy(s.memory, memory, sizeof(s.memory));
+}
+
+// RLE Z80: пять и больше одинаковых байт, а также два и больше ED -
+// ED ED n b; байт сразу за одиночным ED в блок не берется. dst - не меньше
+// 2*n. Возвращает длину сжатых данных
+int Z80Spectrum::z80_rle(const unsigned char* src, int n, unsigned char* dst) {
+
+    int out = 0;
+
+    for (int k = 0; k < n; ) {
+
+        int data = src[k], count = 1;
+        while (k + count < n && src[k + count] == data && count < 255) count++;
+
+        if (count >= 5 || (data == 0xED && count >= 2)) {
+
+            dst[out++] = 0xED;
+            dst[out++] = 0xED;
+            dst[out++] = count;
+            dst[out++] = data;
+            k += count;
+        }
+        else {
+
+            dst[out++] = src[k++];
+            if (data == 0xED && k < n) dst[out++] = src[k++];
+        }
+    }
+
+    return out;
+}
+
+// Z80 v3: страницы по отдельности в RLE, несжимаемая - как есть (FFFF)
+void Z80Spectrum::save_z80(const SnapState& s, FILE* fp) {
+
+    unsigned char head[86];
+    unsigned char pack[2*0x4000];
+
+    memset(head, 0, sizeof(head));
+
+    // Регистры; PC=0 - дальше дополнительный заголовок
+    head[0]  = s.a;
+    head[1]  = s.f;
+    head[2]  = s.c;
+    head[3]  = s.b;
+    head[4]  = s.l;
+    head[5]  = s.h;
+    head[8]  = s.sp & 0xff;
+    head[9]  = s.sp >> 8;
+    head[10] = s.i;
+    head[11] = s.r & 0x7f;
+    head[12] = (s.r >> 7) | (s.border << 1);
+    head[13] = s.e;
+    head[14] = s.d;
+    head[15] = s.c_;
+    head[16] = s.b_;
+    head[17] = s.e_;
+    head[18] = s.d_;
+    head[19] = s.l_;
+    head[20] = s.h_;
+    head[21] = s.a_;
+    head[22] = s.f_;
+    head[23] = s.iy & 0xff;
+    head[24] = s.iy >> 8;
+    head[25] = s.ix & 0xff;
+    head[26] = s.ix >> 8;
+    head[27] = s.iff1 ? 1 : 0;
+    head[28] = s.iff2 ? 1 : 0;
+    head[29] = s.imode & 3;
+
+    // HALT в Z80 не записывается: PC на самой команде, она выполнится снова
+    int pc_ = s.halted ? (s.pc - 1) & 0xffff : s.pc;
+
+    // v3: 54 байта, машина 0 (48k) или 4 (128k)
+    head[30] = 54;
+    head[32] = pc_ & 0xff;
+    head[33] = pc_ >> 8;
+    head[34] = s.is128 ? 4 : 0;
+    head[35] = s.is128 ? s.port_7ffd : 0;
+    // AY: порты FFFD/BFFD есть и в режиме 48K, поэтому регистры пишутся
+    // всегда. Второго чипа TurboSound в Z80 нет - он есть только в SZX
+    head[37] = 0x04;
+    head[38] = s.ay_cur[0];
+    for (int _a = 0; _a < 16; _a++) head[39+_a] = s.ay_regs[0][_a];
+
+    // 0000-3FFF - ПЗУ
+    head[61] = 0xff;
+    head[62] = 0xff;
+
+    fwrite(head, 1, sizeof(head), fp);
+
+    // Страницы: 128k - 3..10, 48k - 8, 4, 5 (банки 5, 2, 0)
+    static const int banks48[3] = { 5, 2, 0 };
+    static const int pages48[3] = { 8, 4, 5 };
+
+    for (int n = 0; n < (s.is128 ? 8 : 3); n++) {
+
+        int bank = s.is128 ? n     : banks48[n];
+        int page = s.is128 ? n + 3 : pages48[n];
+
+        const unsigned char* src = s.memory + bank*0x4000;
+        int size = z80_rle(src, 0x4000, pack);
+
+        unsigned char block[3] = { (unsigned char) size, (unsigned char)(size >> 8), (unsigned char) page };
+
+        if (size < 0x4000) {
+
+            fwrite(block, 1, 3, fp);
+            fwrite(pack, 1, size, fp);
+        }
+        else {
+
+            block[0] = block[1] = 0xff;
+            fwrite(block, 1, 3, fp);
+            fwrite(src, 1, 0x4000, fp);
+        }
+    }
+}
+
+// Блок SZX: ID и длина
+static void szx_chunk(FILE* fp, const char* id, int size) {
+
+    unsigned char head[8] = { (unsigned char) id[0], (unsigned char) id[1], (unsigned char) id[2], (unsigned char) id[3],
+                              (unsigned char) size, (unsigned char)(size >> 8), (unsigned char)(size >> 16), (unsigned char)(size >> 24) };
+
+    fwrite(head, 1, 8, fp);
+}
+
+// SZX 1.4: Z80R, SPCR, AY (и AYTS с TurboSound) и страницы RAMP, сжатые zlib
+void Z80Spectrum::save_szx(const SnapState& s, FILE* fp) {
+
+    unsigned char head[8] = { 'Z', 'X', 'S', 'T', 1, 4, (unsigned char)(s.is128 ? 2 : 1), 0 };
+    unsigned char regs[37], spcr[8], ay_block[18];
+
+    fwrite(head, 1, 8, fp);
+
+    // Пары младшим байтом вперед, F раньше A
+    unsigned char pairs[24] = {
+        (unsigned char) s.f,  (unsigned char) s.a,  (unsigned char) s.c,  (unsigned char) s.b,
+        (unsigned char) s.e,  (unsigned char) s.d,  (unsigned char) s.l,  (unsigned char) s.h,
+        (unsigned char) s.f_, (unsigned char) s.a_, (unsigned char) s.c_, (unsigned char) s.b_,
+        (unsigned char) s.e_, (unsigned char) s.d_, (unsigned char) s.l_, (unsigned char) s.h_,
+        (unsigned char) s.ix, (unsigned char)(s.ix >> 8), (unsigned char) s.iy, (unsigned char)(s.iy >> 8),
+        (unsigned char) s.sp, (unsigned char)(s.sp >> 8), (unsigned char) s.pc, (unsigned char)(s.pc >> 8) };
+
+    memset(regs, 0, sizeof(regs));
+    memcpy(regs, pairs, 24);
+
+    regs[24] = s.i;
+    regs[25] = s.r;
+    regs[26] = s.iff1 ? 1 : 0;
+    regs[27] = s.iff2 ? 1 : 0;
+    regs[28] = s.imode & 3;
+    regs[34] = s.halted ? 2 : 0;    // chFlags: HALT
+
+    szx_chunk(fp, "Z80R", sizeof(regs));
+    fwrite(regs, 1, sizeof(regs), fp);
+
+    // Бордюр, 7FFD, 1FFD, последнее значение FE
+    memset(spcr, 0, sizeof(spcr));
+    spcr[0] = s.border;
+    spcr[1] = s.is128 ? s.port_7ffd : 0;
+    spcr[3] = s.port_fe;
+
+    szx_chunk(fp, "SPCR", sizeof(spcr));
+    fwrite(spcr, 1, sizeof(spcr), fp);
+
+    // AY есть и у 48K (флаг ZXSTAYF_128AY)
+    ay_block[0] = s.is128 ? 0 : 2;
+    ay_block[1] = s.ay_cur[0];
+    for (int _a = 0; _a < 16; _a++) ay_block[2+_a] = s.ay_regs[0][_a];
+
+    szx_chunk(fp, "AY\0\0", sizeof(ay_block));
+    fwrite(ay_block, 1, sizeof(ay_block), fp);
+
+    // Второй чип TurboSound - свой блок в формате AY, вместо флагов -
+    // выбранный чип. Другие эмуляторы неизвестный блок пропускают
+    if (s.ay_chips > 1) {
+
+        ay_block[0] = s.ay_sel;
+        ay_block[1] = s.ay_cur[1];
+        for (int _a = 0; _a < 16; _a++) ay_block[2+_a] = s.ay_regs[1][_a];
+
+        szx_chunk(fp, "AYTS", sizeof(ay_block));
+        fwrite(ay_block, 1, sizeof(ay_block), fp);
+    }
+
+    // Страницы: флаги (бит 0 - zlib), номер банка, данные
+    uLongf bound = compressBound(0x4000);
+    unsigned char* pack = (unsigned char*) malloc(bound);
+
+    for (int bank = 0; bank < 8; bank++) {
+
+        if (!s.is128 && bank != 0 && bank != 2 && bank != 5) continue;
+
+        uLongf size = bound;
+        compress2(pack, &size, s.memory + bank*0x4000, 0x4000, Z_DEFAULT_COMPRESSION);
+
+        unsigned char ramp[3] = { 1, 0, (unsigned char) bank };
+
+        szx_chunk(fp, "RAMP", 3 + size);
+        fwrite(ramp, 1, 3, fp);
+        fwrite(pack, 1, size, fp);
+    }
+
+    free(pack);
+}
+
+// Запись снимка: формат по расширению, .szx - SZX, иначе Z80 v3
+int Z80Spectrum::snap_save(const SnapState& s, const char* filename) {
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) { printf("Can't write file %s\n", filename); return 0; }
+
+    const char* ext = strrchr(filename, '.');
+
+    if (ext && (strcmp(ext, ".szx") == 0 || strcmp(ext, ".SZX") == 0))
+         save_szx(s, fp);
+    else save_z80(s, fp);
+
+    fclose(fp);
+    return 1;
+}
+
+// Снапшот по окончании работы (-Z): только после штатного завершения
+// эмуляции. При выходе по ошибке файл пользователя не перезаписывается
+void Z80Spectrum::snap_final() {
+
+    if (snap_thread.joinable()) snap_thread.join();
+    if (snapshot_file) save_snapshot(snapshot_file);
+}
+
+// Сохранение снапшота сразу; .sna пишет savesna. 0 - не записан
+int Z80Spectrum::save_snapshot(const char* filename) {
+
+    const char* ext = strrchr(filename, '.');
+
+    if (ext && (strcmp(ext, ".sna") == 0 || strcmp(ext, ".SNA") == 0)) return savesna(filename);
+
+    SnapState* s = new SnapState;
+
+    snap_capture(*s);
+    int ok = snap_save(*s, filename);
+
+    delete s;
+    return ok;
+}
+
+// Сохранение в фоне: снимок - сейчас, сжатие и запись - в потоке.
+// Предыдущая запись к этому времени обычно уже закончена
+void Z80Spectrum::snap_background(const char* filename) {
+
+    if (snap_thread.joinable()) snap_thread.join();
+
+    SnapState* s = new SnapState;
+    snap_capture(*s);
+
+    snap_thread = std::thread(&Z80Spectrum::snap_writer, this, s, filename);
+}
+
+// Поток фоновой записи
+void Z80Spectrum::snap_writer(SnapState* s, const char* filename) {
+
+    if (snap_save(*s, filename)) printf("Snapshot saved: %s\n", filename);
+    delete s;
 }
@@ -0,0 +1,402 @@
+// -----------------------------------------------------------------
+// Индексатор и конвертер коллекций снапшотов
+// -----------------------------------------------------------------
+
+// Дерево каталогов обходится один раз, файлы разбирают потоки: у каждого
+// своя машина без ПЗУ, загрузка - load_sna/load_z80/load_szx и tape_index
+// из эмулятора. На каждый файл в индекс идет запись: формат, машина, точка
+// входа, хеш каждого банка ОЗУ (FNV-1a) и эскиз экрана 64x48.
+//
+//   vmzx-snaptool [-j потоков] [-i индекс] [-c z80|szx|sna -o каталог] каталог|файл ...
+//   vmzx-snaptool -l индекс
+//
+// Индекс - плоский файл: заголовок SnapIndexHeader, записи SnapIndexRecord
+// в порядке обхода, затем пути (UTF-8 как в файловой системе, без нулей).
+// С -c снапшоты (не ленты) пишутся из уже загруженной машины в каталог -o
+// под именем относительного пути, где '/' и '.' заменены на '_'.
+
+#define main vmzx_main
+#include "main.cc"
+#undef main
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <memory>
+
+#define INDEX_MAGIC     "VMZXIDX\x1A"
+#define INDEX_VERSION   1
+#define THUMB_W         64
+#define THUMB_H         48
+
+// Машина в записи индекса
+#define MACHINE_NONE    0   // Лента, экран, ошибка
+#define MACHINE_48K     1
+#define MACHINE_128K    2
+
+// Точка входа ленты: строка автостарта бейсика, нет - ENTRY_NONE
+#define ENTRY_NONE      0xFFFF
+
+struct __attribute__((__packed__)) SnapIndexHeader {
+    char            magic[8];
+    unsigned int    version;
+    unsigned int    count;          // Записей
+    unsigned int    record_size;
+    unsigned int    strings;        // Байт путей после записей
+};
+
+struct __attribute__((__packed__)) SnapIndexRecord {
+    unsigned int        path;       // Смещение пути в блоке путей
+    unsigned short      path_len;
+    unsigned char       format;     // FILE_*
+    unsigned char       status;     // LOAD_*
+    unsigned char       machine;    // MACHINE_*
+    unsigned char       reserved;
+    unsigned short      entry;      // PC снапшота или строка автостарта ленты
+    unsigned int        size;       // Размер файла
+    unsigned long long  hash[8];    // Банки 0..7, 0 - банка нет в файле
+    unsigned char       thumb[THUMB_W*THUMB_H/2];   // Цвет 0..15, два пикселя в байте
+};
+
+class SnapTool final : public Z80Spectrum {
+public:
+
+    // Без ПЗУ; ленты корпуса открываются молча
+    SnapTool() : Z80Spectrum(0) { tape_quiet = 1; }
+
+    void    scan(const char* filename, SnapIndexRecord& rec);
+    void    scan_tape(SnapIndexRecord& rec);
+    void    thumbnail(const unsigned char* screen, unsigned char* thumb);
+    int     convert(const char* out) { return save_snapshot(out); }
+
+    static int list(const char* filename);
+};
+
+// FNV-1a, 64 бита
+static unsigned long long page_hash(const unsigned char* p, int n) {
+
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (int _i = 0; _i < n; _i++) h = (h ^ p[_i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+// Эскиз: блок 4x4 точки - цвет чернил, если их в блоке не меньше половины,
+// иначе бумаги; яркость из атрибута
+void SnapTool::thumbnail(const unsigned char* screen, unsigned char* thumb) {
+
+    memset(thumb, 0, THUMB_W*THUMB_H/2);
+
+    for (int ty = 0; ty < THUMB_H; ty++)
+    for (int tx = 0; tx < THUMB_W; tx++) {
+
+        int ink = 0;
+
+        for (int y = ty*4; y < ty*4 + 4; y++) {
+
+            int bits = screen[lookupfb[y] - 0x4000 + tx/2];
+            ink += __builtin_popcount((bits >> ((tx & 1) ? 0 : 4)) & 15);
+        }
+
+        int attr  = screen[6144 + (ty/2)*32 + tx/2];
+        int color = (ink >= 8 ? attr & 7 : (attr >> 3) & 7) | ((attr & 0x40) ? 8 : 0);
+
+        thumb[(ty*THUMB_W + tx) / 2] |= (tx & 1) ? color : color << 4;
+    }
+}
+
+// Лента: автостарт первой программы, эскиз - первый блок размером с экран
+void SnapTool::scan_tape(SnapIndexRecord& rec) {
+
+    int thumb = 0;
+
+    for (int blk = 0; tape_index(blk); blk++) {
+
+        TapeBlock& tb = tape_blocks[blk];
+        TapeData td;
+
+        // PZX DATA: число бит, хвост, длины импульсов бит 0 и 1, байты
+        if (tb.type == TAPE_PZX_DATA && tb.size >= 8) {
+
+            td.data = tb.pos + 8 + 2*(tape_get(tb.pos + 6, 1) + tape_get(tb.pos + 7, 1));
+            td.size = ((tape_get(tb.pos, 4) & 0x7FFFFFFF) + 7) / 8;
+
+            if (td.data + td.size > tb.pos + tb.size) continue;
+        }
+        else if (tb.type == TAPE_TAP_BLOCK || tb.type == 0x10 || tb.type == 0x11 || tb.type == 0x14) {
+            tape_data(tb, td);
+        }
+        else continue;
+
+        const unsigned char* p = tapfile + td.data;
+
+        // Заголовок программы: флаг 0, тип 0, параметр 1 - строка автостарта
+        if (rec.entry == ENTRY_NONE && td.size >= 19 && p[0] == 0x00 && p[1] == 0x00) {
+
+            int line = p[14] + 256*p[15];
+            if (line < 10000) rec.entry = line;
+        }
+
+        // SCREEN$: флаг FF, 6912 байт, контрольная сумма
+        if (!thumb && td.size == 6914 && p[0] == 0xFF) {
+
+            thumbnail(p + 1, rec.thumb);
+            thumb = 1;
+        }
+    }
+}
+
+// Разбор одного файла
+void SnapTool::scan(const char* filename, SnapIndexRecord& rec) {
+
+    int size;
+    const unsigned char* p = map_file(filename, &size);
+
+    rec.size    = size;
+    rec.entry   = ENTRY_NONE;
+    rec.machine = MACHINE_NONE;
+    rec.status  = LOAD_NO_FILE;
+
+    if (p == NULL) return;
+
+    rec.format = file_detect(p, size);
+    rec.status = LOAD_OK;
+
+    // Банков, которых нет в файле, нет и в хешах
+    memset(memory, 0, sizeof(memory));
+
+    switch (rec.format) {
+
+        case FILE_SNA: rec.status = load_sna(p, size); break;
+        case FILE_Z80: rec.status = load_z80(p, size); break;
+        case FILE_SZX: rec.status = load_szx(p, size); break;
+        case FILE_SCR: thumbnail(p, rec.thumb); break;
+
+        // Ленту tape.cc читает прямо из отображения
+        case FILE_TAP:
+        case FILE_TZX:
+        case FILE_PZX:
+
+            tapfile = p;
+            tapsize = size;
+            tape_open();
+            scan_tape(rec);
+            tapfile = NULL;
+            tapsize = 0;
+            break;
+
+        default: rec.status = LOAD_UNKNOWN;
+    }
+
+    if (rec.status == LOAD_OK && (rec.format == FILE_SNA || rec.format == FILE_Z80 || rec.format == FILE_SZX)) {
+
+        int is48 = (port_7ffd & 0x37) == 0x30;
+
+        rec.machine = is48 ? MACHINE_48K : MACHINE_128K;
+        rec.entry   = pc;
+
+        for (int bank = 0; bank < 8; bank++) {
+            if (!is48 || bank == 0 || bank == 2 || bank == 5) rec.hash[bank] = page_hash(memory + bank*0x4000, 0x4000);
+        }
+
+        // Экран - банк 5 или теневой 7
+        thumbnail(memory + ((port_7ffd & 8) ? 7 : 5)*0x4000, rec.thumb);
+    }
+
+    unmap_file(p, size);
+}
+
+// Обход дерева: файлы по порядку имен, чтобы индекс не зависел от ФС
+static void walk(const std::string& path, std::vector<std::string>& files) {
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) { fprintf(stderr, "%s: no such file\n", path.c_str()); return; }
+
+    if (!S_ISDIR(st.st_mode)) { files.push_back(path); return; }
+
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) return;
+
+    std::vector<std::string> names;
+    while (struct dirent* de = readdir(dir)) {
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) names.push_back(de->d_name);
+    }
+
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (size_t _i = 0; _i < names.size(); _i++) walk(path + "/" + names[_i], files);
+}
+
+// Имя файла конвертации: относительный путь, '/' и '.' заменены на '_',
+// и новое расширение: game.z80 и game.sna не затрут друг друга
+static std::string convert_name(const std::string& path, const std::string& root, const char* dir, const char* format) {
+
+    std::string rel = path.compare(0, root.size(), root) == 0 && path.size() > root.size() ? path.substr(root.size()) : path;
+
+    while (rel.size() && rel[0] == '/') rel.erase(0, 1);
+    for (size_t _i = 0; _i < rel.size(); _i++) if (rel[_i] == '/' || rel[_i] == '.') rel[_i] = '_';
+
+    return std::string(dir) + "/" + rel + "." + format;
+}
+
+// Вывод индекса текстом
+int SnapTool::list(const char* filename) {
+
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) { fprintf(stderr, "Can't open file %s\n", filename); return 1; }
+
+    SnapIndexHeader head;
+
+    if (fread(&head, sizeof(head), 1, fp) != 1 || memcmp(head.magic, INDEX_MAGIC, 8) ||
+        head.version != INDEX_VERSION || head.record_size != sizeof(SnapIndexRecord)) {
+
+        fprintf(stderr, "%s: not a snapshot index\n", filename);
+        fclose(fp);
+        return 1;
+    }
+
+    std::vector<SnapIndexRecord> recs(head.count);
+    std::vector<char> strings(head.strings + 1);
+
+    if (fread(recs.data(), sizeof(SnapIndexRecord), head.count, fp) != head.count ||
+        fread(strings.data(), 1, head.strings, fp) != head.strings) {
+
+        fprintf(stderr, "%s: truncated index\n", filename);
+        fclose(fp);
+        return 1;
+    }
+
+    fclose(fp);
+
+    static const char* formats[8] = { "?", "sna", "z80", "szx", "tap", "tzx", "pzx", "scr" };
+    static const char* machines[3] = { "-", "48k", "128k" };
+
+    for (unsigned int _i = 0; _i < head.count; _i++) {
+
+        SnapIndexRecord& r = recs[_i];
+        if (r.path + r.path_len > head.strings || r.format > 7 || r.machine > 2) continue;
+
+        char entry[8] = "-";
+        if (r.entry != ENTRY_NONE) snprintf(entry, sizeof(entry), "%04X", r.entry);
+
+        printf("%-3s %-4s %-4s %8u ", formats[r.format], machines[r.machine], entry, r.size);
+
+        for (int bank = 0; bank < 8; bank++) printf(r.hash[bank] ? " %08x" : " --------", (unsigned int)(r.hash[bank] >> 32));
+
+        printf("  %.*s%s%s\n", r.path_len, &strings[r.path], r.status ? ": " : "", r.status ? load_message(r.status) : "");
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    const char* index   = NULL;
+    const char* format  = NULL;
+    const char* out_dir = ".";
+    int threads = std::thread::hardware_concurrency();
+
+    std::vector<std::string> files, roots;
+
+    for (int u = 1; u < argc; u++) {
+
+        if      (strcmp(argv[u], "-l") == 0 && u + 1 < argc) return SnapTool::list(argv[u + 1]);
+        else if (strcmp(argv[u], "-i") == 0 && u + 1 < argc) index   = argv[++u];
+        else if (strcmp(argv[u], "-c") == 0 && u + 1 < argc) format  = argv[++u];
+        else if (strcmp(argv[u], "-o") == 0 && u + 1 < argc) out_dir = argv[++u];
+        else if (strcmp(argv[u], "-j") == 0 && u + 1 < argc) threads = atoi(argv[++u]);
+        else if (argv[u][0] == '-') {
+
+            fprintf(stderr, "Usage: vmzx-snaptool [-j threads] [-i index] [-c z80|szx|sna -o dir] dir|file ...\n"
+                            "       vmzx-snaptool -l index\n");
+            return 1;
+        }
+        else {
+
+            // Корень для имен конвертации - у каждого файла свой
+            walk(argv[u], files);
+            roots.resize(files.size(), argv[u]);
+        }
+    }
+
+    if (format && strcmp(format, "z80") && strcmp(format, "szx") && strcmp(format, "sna")) {
+        fprintf(stderr, "Unknown format %s\n", format); return 1;
+    }
+
+    if (threads < 1) threads = 1;
+
+    int count = files.size();
+    std::vector<SnapIndexRecord> recs(count);
+    std::atomic<int> next(0), converted(0), failed(0);
+
+    memset(recs.data(), 0, count * sizeof(SnapIndexRecord));
+
+    // Машины создаются заранее: таблицы AY и blip заполняет первый конструктор
+    std::vector<std::unique_ptr<SnapTool>> vms;
+    for (int _t = 0; _t < threads; _t++) vms.emplace_back(new SnapTool);
+
+    // Потоки берут файлы по одному: размеры файлов сильно разные
+    auto worker = [&](SnapTool* vm) {
+
+        for (int n; (n = next++) < count; ) {
+
+            vm->scan(files[n].c_str(), recs[n]);
+
+            int f = recs[n].format;
+            if (!format || recs[n].status != LOAD_OK || (f != FILE_SNA && f != FILE_Z80 && f != FILE_SZX)) continue;
+
+            // Машина уже в состоянии из снапшота
+            std::string out = convert_name(files[n], roots[n], out_dir, format);
+            if (vm->convert(out.c_str())) converted++; else failed++;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> pool;
+    for (int _t = 0; _t < threads; _t++) pool.push_back(std::thread(worker, vms[_t].get()));
+    for (int _t = 0; _t < threads; _t++) { pool[_t].join(); vms[_t].reset(); }
+
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int broken = 0;
+    for (int _i = 0; _i < count; _i++) if (recs[_i].status != LOAD_OK) broken++;
+
+    fprintf(stderr, "%d files, %d not loaded, %.2f s, %d threads", count, broken, sec, threads);
+    if (format) fprintf(stderr, ", converted %d, failed %d", (int) converted, (int) failed);
+    fprintf(stderr, "\n");
+
+    if (index == NULL) return 0;
+
+    // Пути - одним блоком после записей
+    std::string strings;
+
+    for (int _i = 0; _i < count; _i++) {
+
+        recs[_i].path     = strings.size();
+        recs[_i].path_len = files[_i].size();
+        strings += files[_i];
+    }
+
+    SnapIndexHeader head;
+
+    memcpy(head.magic, INDEX_MAGIC, 8);
+    head.version     = INDEX_VERSION;
+    head.count       = count;
+    head.record_size = sizeof(SnapIndexRecord);
+    head.strings     = strings.size();
+
+    FILE* fp = fopen(index, "wb");
+    if (fp == NULL) { fprintf(stderr, "Can't write file %s\n", index); return 1; }
+
+    fwrite(&head, sizeof(head), 1, fp);
+    fwrite(recs.data(), sizeof(SnapIndexRecord), count, fp);
+    fwrite(strings.data(), 1, strings.size(), fp);
+    fclose(fp);
+
+    return 0;
+}
@@ -0,0 +1,852 @@
+// -----------------------------------------------------------------
+// Магнитофон: лента как последовательность импульсов
+// -----------------------------------------------------------------
+
+// Файл ленты (TAP, TZX, PZX) отображается в память целиком, но ни
+// оглавление, ни импульсы заранее не строятся. Заголовки блоков
+// разбираются, когда до блока дошла очередь (tape_index), а генератор
+// переводит блок в отрезки одинаковых импульсов порциями по TAPE_CHUNK:
+// следующая порция собирается, когда курсор доиграл предыдущую. Поэтому
+// многомегабайтная прямая запись не требует ни памяти, ни времени на старте.
+//
+// Генератор выдает интервалы постоянного уровня; соседние интервалы
+// одного уровня сливаются, и в отрезок интервал попадает, только когда
+// за ним известен перепад. Импульс TZX - перепад и удержание уровня,
+// так что после паузы или прямой записи первый импульс всегда с перепадом.
+// Уровень в момент t находится сдвигом курсора вперед: целые отрезки
+// пропускаются за один шаг, поэтому чтение порта стоит O(1).
+//
+// Время ленты - cpu_clock, сумма тактов исполненных инструкций, а не
+// такты кадра (8 на инструкцию): циклы загрузчика ПЗУ меряют импульсы
+// числом своих инструкций и ждут настоящих тактов Z80.
+
+// Лента из tapfile: формат по сигнатуре, курсор на первом блоке
+void Z80Spectrum::tape_open() {
+
+    tape_format = TAPE_TAP;
+    tape_scan   = 0;
+
+    if (tapsize >= 10 && memcmp(tapfile, "ZXTape!\x1A", 8) == 0) {
+
+        tape_format = TAPE_TZX;
+        tape_scan   = 10;
+    }
+    else if (tapsize >= 8 && memcmp(tapfile, "PZXT", 4) == 0) {
+        tape_format = TAPE_PZX;
+    }
+
+    tape_block_count = 0;
+    tape_seek(0);
+
+    if (!tape_quiet)
+        printf("tape: %s, %d bytes\n", tape_format == TAPE_TZX ? "TZX" : tape_format == TAPE_PZX ? "PZX" : "TAP", tapsize);
+}
+
+// Число из n байт (младший первым); за концом файла - 0
+unsigned int Z80Spectrum::tape_get(int pos, int n) {
+
+    if (pos < 0 || pos + n > tapsize) return 0;
+
+    unsigned int v = 0;
+    for (int _i = n - 1; _i >= 0; _i--) v = (v << 8) | tapfile[pos + _i];
+
+    return v;
+}
+
+// Разобрать заголовки блоков до n-го включительно; 0 - блока n нет
+int Z80Spectrum::tape_index(int n) {
+
+    if (n < 0) return 0;
+
+    while (tape_block_count <= n) {
+
+        int pos = tape_scan, type, body;
+        long long size;
+
+        if (tape_format == TAPE_TAP) {
+
+            if (pos + 2 > tapsize) return 0;
+
+            type = TAPE_TAP_BLOCK;
+            body = pos + 2;
+            size = tape_get(pos, 2);
+        }
+        else if (tape_format == TAPE_PZX) {
+
+            if (pos + 8 > tapsize) return 0;
+
+            const char* tag = (const char*) tapfile + pos;
+
+            type = memcmp(tag, "PULS", 4) == 0 ? TAPE_PZX_PULS :
+                   memcmp(tag, "DATA", 4) == 0 ? TAPE_PZX_DATA :
+                   memcmp(tag, "PAUS", 4) == 0 ? TAPE_PZX_PAUS :
+                   memcmp(tag, "STOP", 4) == 0 ? TAPE_PZX_STOP : TAPE_PZX_INFO;
+            body = pos + 8;
+            size = tape_get(pos + 4, 4);
+        }
+        else {
+
+            if (pos + 1 > tapsize) return 0;
+
+            type = tapfile[pos];
+            body = pos + 1;
+
+            // Длина тела по ID; у неизвестных блоков - DWORD сразу за ID
+            switch (type) {
+
+                case 0x10: size = 4  + tape_get(body + 2, 2); break;
+                case 0x11: size = 18 + tape_get(body + 15, 3); break;
+                case 0x12: size = 4; break;
+                case 0x13: size = 1  + 2*tape_get(body, 1); break;
+                case 0x14: size = 10 + tape_get(body + 7, 3); break;
+                case 0x15: size = 8  + tape_get(body + 5, 3); break;
+                case 0x20:
+                case 0x23:
+                case 0x24: size = 2; break;
+                case 0x21:
+                case 0x30: size = 1  + tape_get(body, 1); break;
+                case 0x22:
+                case 0x25:
+                case 0x27: size = 0; break;
+                case 0x26: size = 2  + 2*tape_get(body, 2); break;
+                case 0x28:
+                case 0x32: size = 2  + tape_get(body, 2); break;
+                case 0x31: size = 2  + tape_get(body + 1, 1); break;
+                case 0x33: size = 1  + 3*tape_get(body, 1); break;
+                case 0x34: size = 8; break;
+                case 0x35: size = 20 + (long long) tape_get(body + 16, 4); break;
+                case 0x40: size = 4  + tape_get(body + 1, 3); break;
+                case 0x5A: size = 9; break;
+                default:   size = 4  + (long long) tape_get(body, 4); break;
+            }
+        }
+
+        // Обрезанный файл: сколько есть
+        if (size > tapsize - body) size = tapsize - body;
+
+        if (tape_block_count == tape_block_max) {
+
+            tape_block_max = tape_block_max ? 2*tape_block_max : 64;
+            tape_blocks    = (TapeBlock*) realloc(tape_blocks, tape_block_max * sizeof(TapeBlock));
+        }
+
+        TapeBlock& b = tape_blocks[tape_block_count++];
+
+        b.type = type;
+        b.pos  = body;
+        b.size = (int) size;
+
+        tape_scan = body + b.size;
+
+        // Заголовок стандартного блока: тип файла и имя
+        int hdr = type == 0x10 ? body + 4 : body;
+
+        if ((type == TAPE_TAP_BLOCK || type == 0x10) && body + b.size - hdr == 19 && tapfile[hdr] == 0 && !tape_quiet)
+            printf("tape: block %d, header type %d \"%.10s\"\n", tape_block_count - 1, tapfile[hdr + 1], tapfile + hdr + 2);
+    }
+
+    return 1;
+}
+
+// Тайминги и байты блока данных
+void Z80Spectrum::tape_data(TapeBlock& b, TapeData& d) {
+
+    int p = b.pos, head = 0, last = 8;
+
+    d.pilot  = TAPE_PILOT;
+    d.pilots = 0;
+    d.sync1  = TAPE_SYNC1;
+    d.sync2  = TAPE_SYNC2;
+    d.bit0   = TAPE_BIT0;
+    d.bit1   = TAPE_BIT1;
+    d.pause  = TAPE_PAUSE;
+
+    switch (b.type) {
+
+        // Стандартный: пауза, длина
+        case 0x10:
+
+            d.pause = tape_get(p, 2);
+            head    = 4;
+            break;
+
+        // Турбо: свои тайминги и число бит в последнем байте
+        case 0x11:
+
+            d.pilot  = tape_get(p, 2);
+            d.sync1  = tape_get(p + 2, 2);
+            d.sync2  = tape_get(p + 4, 2);
+            d.bit0   = tape_get(p + 6, 2);
+            d.bit1   = tape_get(p + 8, 2);
+            d.pilots = tape_get(p + 10, 2);
+            last     = tape_get(p + 12, 1);
+            d.pause  = tape_get(p + 13, 2);
+            head     = 18;
+            break;
+
+        // Только данные: без пилота и синхроимпульсов
+        case 0x14:
+
+            d.bit0  = tape_get(p, 2);
+            d.bit1  = tape_get(p + 2, 2);
+            last    = tape_get(p + 4, 1);
+            d.pause = tape_get(p + 5, 2);
+            head    = 10;
+            break;
+    }
+
+    if (last < 1 || last > 8) last = 8;
+
+    d.data = p + head;
+    d.size = b.size > head ? b.size - head : 0;
+    d.bits = d.size ? (d.size - 1) * 8 + last : 0;
+
+    // Стандартный блок: пилот заголовка (флаг < 128) длиннее
+    if (b.type == TAPE_TAP_BLOCK || b.type == 0x10)
+        d.pilots = !d.size ? 0 : tapfile[d.data] & 0x80 ? TAPE_PILOT_DATA : TAPE_PILOT_HDR;
+}
+
+// -----------------------------------------------------------------
+// Генератор импульсов
+// -----------------------------------------------------------------
+
+// Дописать отрезок; соседние одинаковые импульсы сливаются
+void Z80Spectrum::tape_add(int len, int count) {
+
+    if (tape_seg_count) {
+
+        TapeSeg& last = tape_segs[tape_seg_count - 1];
+
+        if (last.len == len) {
+
+            last.count += count;
+            return;
+        }
+    }
+
+    if (tape_seg_count == tape_seg_max) {
+
+        tape_seg_max = tape_seg_max ? 2*tape_seg_max : TAPE_CHUNK + 1024;
+        tape_segs    = (TapeSeg*) realloc(tape_segs, tape_seg_max * sizeof(TapeSeg));
+    }
+
+    TapeSeg& s = tape_segs[tape_seg_count++];
+
+    s.len   = len;
+    s.count = count;
+}
+
+// Отложенный интервал - в отрезок: за ним перепад
+void Z80Spectrum::tape_flush() {
+
+    if (!tape_pend_len) return;
+
+    if (!tape_seg_count) tape_chunk_level = tape_pend_level;
+
+    tape_add(tape_pend_len, 1);
+    tape_pend_len = 0;
+}
+
+// Интервал постоянного уровня; продлевает предыдущий того же уровня
+void Z80Spectrum::tape_run(int len, int level) {
+
+    if (len <= 0) return;
+
+    if (tape_pend_len && tape_pend_level != level) tape_flush();
+
+    // Многоминутная тишина упирается в int: дальше уровень просто держится
+    tape_pend_len   = tape_pend_len > 0x7FFFFFFF - len ? 0x7FFFFFFF : tape_pend_len + len;
+    tape_pend_level = level;
+}
+
+// count импульсов по len тактов: каждый начинается перепадом
+void Z80Spectrum::tape_pulses(int len, int count) {
+
+    if (count <= 0) return;
+
+    // Импульс нулевой длины (PZX) только меняет уровень
+    if (len <= 0) {
+
+        tape_gen_level ^= count & 1;
+        return;
+    }
+
+    tape_gen_level ^= 1;
+    tape_run(len, tape_gen_level);
+
+    if (count == 1) return;
+
+    // Середина - одним отрезком, последний ждет следующего интервала
+    tape_flush();
+    if (count > 2) tape_add(len, count - 2);
+
+    tape_gen_level ^= (count - 1) & 1;
+    tape_pend_len   = len;
+    tape_pend_level = tape_gen_level;
+}
+
+// Пауза - низкий уровень. Если последний импульс был низким, его перепад
+// завершает 1 мс высокого уровня - иначе пауза съела бы этот перепад
+void Z80Spectrum::tape_pause(int len) {
+
+    if (len <= 0) return;
+
+    if (!tape_gen_level && tape_pend_len && len > TAPE_PAUSE_EDGE) {
+
+        tape_run(TAPE_PAUSE_EDGE, 1);
+        len -= TAPE_PAUSE_EDGE;
+    }
+
+    tape_run(len, 0);
+    tape_gen_level = 0;
+}
+
+// Блок данных: пилот, синхроимпульсы, бит - два импульса, пауза.
+// Возвращает 1, когда блок собран целиком
+int Z80Spectrum::tape_gen_data(TapeBlock& b) {
+
+    TapeData d;
+    tape_data(b, d);
+
+    if (tape_gen_stage == 0) {
+
+        if (d.pilots) {
+
+            tape_pulses(d.pilot, d.pilots);
+            tape_pulses(d.sync1, 1);
+            tape_pulses(d.sync2, 1);
+        }
+
+        tape_gen_stage = 1;
+    }
+
+    if (tape_gen_stage == 1) {
+
+        for (; tape_gen_pos < d.bits && tape_seg_count < TAPE_CHUNK; tape_gen_pos++) {
+
+            int bit = (tapfile[d.data + tape_gen_pos / 8] >> (7 - tape_gen_pos % 8)) & 1;
+            tape_pulses(bit ? d.bit1 : d.bit0, 2);
+        }
+
+        if (tape_gen_pos < d.bits) return 0;
+        tape_gen_stage = 2;
+    }
+
+    tape_pause(d.pause * TAPE_MS);
+    return 1;
+}
+
+// TZX 0x15, прямая запись: бит - уровень на время семпла
+int Z80Spectrum::tape_gen_direct(TapeBlock& b) {
+
+    int p    = b.pos + 8;
+    int rate = tape_get(b.pos, 2);
+    int last = tape_get(b.pos + 4, 1);
+    int size = b.size > 8 ? b.size - 8 : 0;
+
+    if (last < 1 || last > 8) last = 8;
+
+    int bits = size ? (size - 1) * 8 + last : 0;
+
+    if (tape_gen_stage == 0) {
+
+        for (; tape_gen_pos < bits && tape_seg_count < TAPE_CHUNK; tape_gen_pos++) {
+
+            int data = tapfile[p + tape_gen_pos / 8];
+
+            // Целый байт тишины или удержания - одним интервалом
+            if ((tape_gen_pos & 7) == 0 && tape_gen_pos + 8 <= bits && (data == 0x00 || data == 0xFF)) {
+
+                tape_gen_level = data & 1;
+                tape_run(8 * rate, tape_gen_level);
+                tape_gen_pos += 7;
+                continue;
+            }
+
+            tape_gen_level = (data >> (7 - (tape_gen_pos & 7))) & 1;
+            tape_run(rate, tape_gen_level);
+        }
+
+        if (tape_gen_pos < bits) return 0;
+        tape_gen_stage = 1;
+    }
+
+    tape_pause(tape_get(b.pos + 2, 2) * TAPE_MS);
+    return 1;
+}
+
+// PZX PULS: импульсы с повтором, первый - низкого уровня
+int Z80Spectrum::tape_gen_puls(TapeBlock& b) {
+
+    if (tape_gen_stage == 0) {
+
+        tape_gen_level = 1;
+        tape_gen_stage = 1;
+    }
+
+    while (tape_gen_pos + 2 <= b.size && tape_seg_count < TAPE_CHUNK) {
+
+        int p     = b.pos + tape_gen_pos;
+        int count = 1;
+        int len   = tape_get(p, 2);
+
+        if (len > 0x8000) {
+
+            count = len & 0x7FFF;
+            len   = tape_get(p += 2, 2);
+        }
+
+        if (len >= 0x8000) len = ((len & 0x7FFF) << 16) | tape_get(p += 2, 2);
+
+        tape_gen_pos = p + 2 - b.pos;
+        tape_pulses(len, count);
+    }
+
+    return tape_gen_pos + 2 > b.size;
+}
+
+// PZX DATA: бит - своя последовательность импульсов, в конце хвост
+int Z80Spectrum::tape_gen_pzx_data(TapeBlock& b) {
+
+    int p     = b.pos;
+    int bits  = tape_get(p, 4) & 0x7FFFFFFF;
+    int tail  = tape_get(p + 4, 2);
+    int p0    = tape_get(p + 6, 1);
+    int p1    = tape_get(p + 7, 1);
+    int s0    = p + 8;
+    int s1    = s0 + 2*p0;
+    int data  = s1 + 2*p1;
+    long long room = 8LL * (b.pos + b.size - data);
+
+    if (bits > room) bits = room > 0 ? (int) room : 0;
+
+    if (tape_gen_stage == 0) {
+
+        tape_gen_level = !(tape_get(p, 4) >> 31);
+        tape_gen_stage = 1;
+    }
+
+    if (tape_gen_stage == 1) {
+
+        for (; tape_gen_pos < bits && tape_seg_count < TAPE_CHUNK; tape_gen_pos++) {
+
+            int bit = (tapfile[data + tape_gen_pos / 8] >> (7 - tape_gen_pos % 8)) & 1;
+            int s   = bit ? s1 : s0;
+
+            for (int _i = 0; _i < (bit ? p1 : p0); _i++) tape_pulses(tape_get(s + 2*_i, 2), 1);
+        }
+
+        if (tape_gen_pos < bits) return 0;
+        tape_gen_stage = 2;
+    }
+
+    if (tail) tape_pulses(tail, 1);
+    return 1;
+}
+
+// Шаг генератора: очередная часть блока tape_gen_block; собран блок -
+// переход к следующему с учетом циклов, переходов и вызовов TZX
+void Z80Spectrum::tape_gen() {
+
+    TapeBlock b = tape_blocks[tape_gen_block];
+    int p = b.pos, next = tape_gen_block + 1;
+
+    switch (b.type) {
+
+        case TAPE_TAP_BLOCK:
+        case 0x10:
+        case 0x11:
+        case 0x14: if (!tape_gen_data(b)) return; break;
+        case 0x15: if (!tape_gen_direct(b)) return; break;
+
+        case TAPE_PZX_PULS: if (!tape_gen_puls(b)) return; break;
+        case TAPE_PZX_DATA: if (!tape_gen_pzx_data(b)) return; break;
+
+        // Чистый тон и последовательность импульсов
+        case 0x12: tape_pulses(tape_get(p, 2), tape_get(p + 2, 2)); break;
+        case 0x13:
+
+            for (int _i = 0; _i < (int) tape_get(p, 1); _i++) tape_pulses(tape_get(p + 1 + 2*_i, 2), 1);
+            break;
+
+        // Пауза; нулевая - остановка магнитофона
+        case 0x20:
+
+            if (tape_get(p, 2)) tape_pause(tape_get(p, 2) * TAPE_MS); else tape_gen_stop = 1;
+            break;
+
+        case TAPE_PZX_PAUS:
+
+            tape_gen_level = tape_get(p, 4) >> 31;
+            tape_run(tape_get(p, 4) & 0x7FFFFFFF, tape_gen_level);
+            break;
+
+        // Остановка в режиме 48K; в PZX флаг 0 - остановка всегда
+        case 0x2A: if (port_7ffd & 0x30) tape_gen_stop = 1; break;
+        case TAPE_PZX_STOP: if (!(tape_get(p, 2) & 1) || (port_7ffd & 0x30)) tape_gen_stop = 1; break;
+
+        // Уровень линии
+        case 0x2B: tape_gen_level = tape_get(p + 4, 1) & 1; break;
+
+        // Переход; нулевой по описанию TZX запрещен
+        case 0x23: next = tape_gen_block + ((short) tape_get(p, 2) ? (short) tape_get(p, 2) : 1); break;
+
+        // Цикл: тело между 0x24 и 0x25 играется заданное число раз
+        case 0x24:
+
+            tape_loop_block = next;
+            tape_loop_left  = tape_get(p, 2);
+            break;
+
+        case 0x25:
+
+            if (tape_loop_left > 1) { tape_loop_left--; next = tape_loop_block; } else tape_loop_left = 0;
+            break;
+
+        // Вызов последовательности: смещения от блока вызова, 0x27 - возврат
+        case 0x26:
+
+            if (tape_get(p, 2)) {
+
+                tape_call_block = tape_gen_block;
+                tape_call_pos   = 0;
+                next = tape_gen_block + (short) tape_get(p + 2, 2);
+            }
+            break;
+
+        case 0x27:
+
+            if (tape_call_block >= 0) {
+
+                int c = tape_blocks[tape_call_block].pos;
+
+                if (++tape_call_pos < (int) tape_get(c, 2)) {
+                    next = tape_call_block + (short) tape_get(c + 2 + 2*tape_call_pos, 2);
+                }
+                else {
+
+                    next = tape_call_block + 1;
+                    tape_call_block = -1;
+                }
+            }
+            break;
+
+        // CSW и обобщенные данные пропускаются
+        case 0x18:
+        case 0x19: printf("tape: block %d (%02X) is not supported\n", tape_gen_block, b.type); break;
+
+        // Остальное - описания, ни импульсов, ни пауз
+        default: break;
+    }
+
+    tape_gen_block = next < 0 ? 0 : next;
+    tape_gen_stage = 0;
+    tape_gen_pos   = 0;
+}
+
+// Следующая порция с позиции генератора. Если в порции уже есть импульсы,
+// она не переходит в следующий блок: по порции виден текущий блок ленты
+void Z80Spectrum::tape_fill() {
+
+    tape_seg_count   = 0;
+    tape_chunk_block = tape_gen_block;
+    tape_chunk_first = tape_gen_stage == 0;
+    tape_chunk_lead  = tape_pend_len != 0;
+
+    for (int _n = 0; tape_seg_count < TAPE_CHUNK; _n++) {
+
+        // Остановка раньше первого импульса порции ничего не останавливает
+        if (tape_gen_stop && !tape_seg_count && !tape_pend_len) tape_gen_stop = 0;
+
+        // Конец ленты, остановка или переходы по кругу без импульсов:
+        // последний интервал - тоже в порцию
+        if (tape_gen_stop || !tape_index(tape_gen_block) || _n > TAPE_GEN_LIMIT) {
+
+            tape_flush();
+            break;
+        }
+
+        int block = tape_gen_block;
+        tape_gen();
+
+        if (tape_gen_block != block && tape_seg_count) break;
+    }
+}
+
+// -----------------------------------------------------------------
+// Курсор
+// -----------------------------------------------------------------
+
+// Курсор и генератор - на начало блока; первый импульс начинается сейчас
+void Z80Spectrum::tape_seek(int block) {
+
+    tape_gen_block  = block;
+    tape_gen_stage  = 0;
+    tape_gen_pos    = 0;
+    tape_gen_level  = 0;
+    tape_gen_stop   = 0;
+    tape_pend_len   = 0;
+    tape_loop_left  = 0;
+    tape_call_block = -1;
+
+    tape_fill();
+    tape_seg = 0;
+
+    if (!tape_seg_count) {
+
+        start_tape = 0;
+        tape_edge  = TAPE_NEVER;
+        return;
+    }
+
+    tape_level = tape_chunk_level;
+    tape_left  = tape_segs[0].count;
+    tape_edge  = cpu_clock + tape_segs[0].len;
+}
+
+// Блок под курсором: на начале которого стоит курсор, иначе следующий
+int Z80Spectrum::tape_block_at() {
+
+    return tape_chunk_first && tape_seg <= tape_chunk_lead ? tape_chunk_block : tape_chunk_block + 1;
+}
+
+// Пуск магнитофона: с начала текущего блока, с конца ленты - сначала
+void Z80Spectrum::tape_play() {
+
+    start_tape = 1;
+    tape_seek(tape_seg_count ? tape_chunk_block : 0);
+}
+
+// Уровень EAR в момент t (t не убывает)
+int Z80Spectrum::tape_ear(long long t) {
+
+    while (t >= tape_edge) {
+
+        TapeSeg& s = tape_segs[tape_seg];
+
+        // Импульсов отрезка, закончившихся к моменту t
+        long long k = (t - tape_edge) / s.len + 1;
+
+        if (k < tape_left) {
+
+            tape_level ^= (k & 1);
+            tape_left  -= k;
+            tape_edge  += k * s.len;
+            break;
+        }
+
+        // Отрезок пройден целиком
+        tape_level ^= (tape_left & 1);
+
+        long long end = tape_edge + (long long)(tape_left - 1) * s.len;
+
+        if (++tape_seg == tape_seg_count) {
+
+            // Блок остановки: магнитофон встает перед следующим блоком
+            if (tape_gen_stop) {
+
+                start_tape = 0;
+                tape_seek(tape_gen_block);
+                break;
+            }
+
+            tape_fill();
+            tape_seg = 0;
+
+            // Лента кончилась - магнитофон останавливается
+            if (!tape_seg_count) {
+
+                start_tape = 0;
+                tape_edge  = TAPE_NEVER;
+                break;
+            }
+        }
+
+        tape_left = tape_segs[tape_seg].count;
+        tape_edge = end + tape_segs[tape_seg].len;
+    }
+
+    return tape_level;
+}
+
+// Такт ближайшего перепада EAR; TAPE_NEVER - перепадов больше не будет
+long long Z80Spectrum::tape_next_edge() {
+
+    return tape_edge;
+}
+
+// -----------------------------------------------------------------
+// Быстрая загрузка: перехват LD-BYTES
+// -----------------------------------------------------------------
+
+// Вызов LD-BYTES (0x0556 в ПЗУ 48K; ПЗУ 128K загружает через него же)
+// выполняется сразу: блок под курсором копируется по IX/DE, регистры и
+// флаги - как после ПЗУ, возврат по адресу со стека. На входе A - флаг
+// блока, CF=1 - загрузка, CF=0 - сверка (VERIFY).
+void Z80Spectrum::tape_trap() {
+
+    // Только ПЗУ 48K, не TR-DOS
+    if (trdos_latch || !(port_7ffd & 0x30)) return;
+
+    // Блок под курсором; описания и прочие блоки без импульсов пропускаются
+    int blk = tape_block_at();
+
+    for (; tape_index(blk); blk++) {
+
+        int type = tape_blocks[blk].type;
+        if (type == TAPE_TAP_BLOCK || (type >= 0x10 && type <= 0x19) || type == TAPE_PZX_PULS || type == TAPE_PZX_DATA) break;
+    }
+
+    // Блоков больше нет: пусть ПЗУ ждет ленту как обычно
+    if (!tape_index(blk)) return;
+
+    // Нестандартный блок грузит сам загрузчик ПЗУ
+    TapeBlock& tb = tape_blocks[blk];
+    if (tb.type != TAPE_TAP_BLOCK && tb.type != 0x10) return;
+
+    TapeData td;
+    tape_data(tb, td);
+
+    const unsigned char* p = tapfile + td.data;
+
+    int verify = !flags.C;
+    int len    = d*256 + e;
+    int ok     = 0, parity = 0, n = 0;
+
+    if (td.size > 0 && p[0] == a) {
+
+        parity = p[0];
+        ok     = 1;
+
+        // После флага ПЗУ читает DE байт и контрольную сумму
+        for (; n < len && n + 1 < td.size; n++) {
+
+            int data = p[1 + n];
+
+            if (verify && mem_read(ix) != data) { ok = 0; break; }
+            if (!verify) mem_write(ix, data);
+
+            parity ^= data;
+            ix = (ix + 1) & 0xffff;
+        }
+
+        if (ok && n + 1 < td.size) parity ^= p[1 + n]; else ok = 0;
+        if (parity) ok = 0;
+    }
+
+    len -= n;
+    d = len >> 8;
+    e = len & 255;
+
+    // Выход как из LD-8-BITS: A - четность, CF - успех
+    a       = parity;
+    flags.C = ok;
+    flags.Z = 0;
+
+    // SA/LD-RET: бордюр из BORDCR, прерывания разрешены
+    border_id = (mem_read(0x5C48) >> 3) & 7;
+    iff1 = iff2 = 1;
+
+    pc = pop_word();
+
+    // Лента - на начало следующего блока
+    tape_seek(blk + 1);
+
+    printf("tape: flash load block %d, %s\n", blk, ok ? "ok" : "error");
+}
+
+// -----------------------------------------------------------------
+// Автотурбо при загрузке
+// -----------------------------------------------------------------
+
+// Загрузчик (ПЗУ или свой) ждет перепады в цикле чтения порта FE - это
+// тысячи чтений за кадр. Пока лента движется и порт так читают, кадры
+// идут без ожидания (emu_loop), звук не выводится, экран показывается
+// каждый TAPE_TURBO_SHOW-й кадр. Остановка ленты сразу возвращает скорость,
+// пауза загрузчика (между блоками) - через TAPE_TURBO_HOLD кадров.
+void Z80Spectrum::tape_turbo_check() {
+
+    if (start_tape && tape_reads >= TAPE_TURBO_READS) {
+
+        tape_turbo = tape_turbo_on;
+        tape_idle  = 0;
+    }
+    else if (tape_turbo && (!start_tape || ++tape_idle >= TAPE_TURBO_HOLD)) {
+        tape_turbo = 0;
+    }
+
+    tape_reads = 0;
+}
+
+// -----------------------------------------------------------------
+// Ускорение цикла ожидания перепада
+// -----------------------------------------------------------------
+
+// Загрузчики, и ПЗУ (LD-SAMPLE), и свои в ОЗУ, ждут перепад в цикле
+//
+//   INC B / RET Z / LD A,n / IN A,(FE) / RRA / [RET NC] / XOR C / AND m / JR Z
+//
+// До ближайшего перепада каждая итерация читает из порта одно и то же:
+// меняются только B, R и время. Эти итерации пропускаются разом, цикл
+// продолжает обычное исполнение с итерации, которая увидит перепад.
+// Прерывания должны быть запрещены, пропуск не выходит за кадр: кадр
+// отводит инструкции по 8 тактов, поэтому пропуск тратит и такты ЦП
+// (cycles), и места инструкций в кадре (slots).
+//
+// Возвращает такты пропущенных итераций (0 - это не такой цикл),
+// used - сколько инструкций они заняли.
+int Z80Spectrum::tape_edge_loop(int slots, int cycles, int& used) {
+
+    // A=0, ZF=1, CF=0 - состояние после AND в конце итерации (или AND A
+    // на входе в ПЗУ); остальные флаги после пропуска ставятся явно
+    if (iff1 || do_delayed_ei || a || !flags.Z || flags.C) return 0;
+
+    unsigned char m[13];
+    for (int _i = 0; _i < 13; _i++) m[_i] = mem_read((pc + _i) & 0xffff);
+
+    if (m[0] != 0x04 || m[1] != 0xC8 || m[2] != 0x3E || m[4] != 0xDB || m[5] != 0xFE || m[6] != 0x1F) return 0;
+
+    // RET NC - выход по BREAK в ПЗУ; без него итерация короче на 5 тактов
+    int brk = m[7] == 0xD0;
+    int ops = 8 + brk;
+    int per = 54 + 5*brk;
+
+    unsigned char* q = m + 7 + brk;
+
+    // JR Z - на начало цикла
+    if (q[0] != 0xA9 || q[1] != 0xE6 || q[3] != 0x28 || q[4] != 256 - (12 + brk)) return 0;
+
+    // Порт при текущем уровне: RRA вдвигает CF=0, выход по RET NC или
+    // по несовпадению с C - тогда итерацию исполняет процессор
+    int port = io_read((m[3] << 8) | 0xFE);
+
+    if (brk && !(port & 1)) return 0;
+    if (((port >> 1) ^ c) & q[2]) return 0;
+
+    // Отсчет порта - через 16 тактов от начала итерации (INC B, RET Z, LD A)
+    long long first = cpu_clock + 16;
+    long long edge  = tape_next_edge();
+
+    if (edge <= first) return 0;
+
+    long long n = (edge - first + per - 1) / per;
+
+    // B не доходит до 0 (RET Z), кадр не кончается
+    if (n > 255 - b)      n = 255 - b;
+    if (n > slots / ops)  n = slots / ops;
+    if (n > cycles / per) n = cycles / per;
+    if (n < 2) return 0;
+
+    b = b + n;
+    r = (r & 0x80) | ((r + ops*n) & 0x7f);
+
+    // Флаги - как после AND последней итерации с нулевым результатом:
+    // Z, H и P/V (четность нуля), S, N, C, F3 и F5 сброшены
+    a = 0;
+    set_flags_register(0x54);
+
+    tape_reads += n;
+    used = ops * n;
+
+    return per * n;
+}
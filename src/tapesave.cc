@@ -0,0 +1,243 @@
+// -----------------------------------------------------------------
+// Запись на ленту
+// -----------------------------------------------------------------
+
+// Перепады MIC (бит 3 порта FE) берутся из того же списка перепадов
+// бипера, что и звук (beep_edges), и копятся импульсами по тактам
+// cpu_clock, как и лента на входе. Нет перепадов дольше SAVE_GAP - блок кончился и
+// сразу разбирается по таймингам ПЗУ: пилот, синхроимпульсы, бит - два
+// импульса. Стандартный блок пишется байтами (TAP, в TZX - блок 0x10),
+// нестандартный в TZX - прямой записью (0x15), в TAP его не записать.
+
+// Допуск импульса: 1/5 от тайминга ПЗУ
+static int save_near(int len, int ref) {
+    return 5 * abs(len - ref) <= ref;
+}
+
+// Открыть файл записи: TZX по расширению, иначе TAP
+void Z80Spectrum::save_open(const char* filename) {
+
+    static const unsigned char head[10] = { 'Z', 'X', 'T', 'a', 'p', 'e', '!', 0x1A, 1, 20 };
+
+    save_file = fopen(filename, "wb");
+    if (save_file == NULL) { fprintf(stderr, "Can't open file %s for writing\n", filename); exit(1); }
+
+    const char* ext = strrchr(filename, '.');
+    save_tzx = ext && (strcmp(ext, ".tzx") == 0 || strcmp(ext, ".TZX") == 0);
+
+    if (save_tzx) fwrite(head, 1, sizeof(head), save_file);
+}
+
+// Неразобранные перепады списка бипера: изменился MIC - перепад ленты.
+// Уровень до первого перепада списка - beep_level
+void Z80Spectrum::mic_take() {
+
+    for (; mic_seen < beep_edge_count; mic_seen++) {
+
+        BeepEdge& e = beep_edges[mic_seen];
+        int prev    = mic_seen ? beep_edges[mic_seen - 1].bits : beep_level;
+
+        if ((e.bits ^ prev) & 0x08) mic_edge(e.bits & 0x08, e.clock);
+    }
+}
+
+// Перепад MIC на такте clock; level - новый уровень
+void Z80Spectrum::mic_edge(int level, long long clock) {
+
+    // Первый перепад начинает блок
+    if (mic_edges++ == 0) {
+
+        mic_level = !level;
+        mic_last  = clock;
+        return;
+    }
+
+    if (mic_count == mic_max) {
+
+        mic_max    = mic_max ? 2*mic_max : 65536;
+        mic_pulses = (int*) realloc(mic_pulses, mic_max * sizeof(int));
+    }
+
+    // Дольше int не бывает: такой промежуток уже закрыл блок
+    mic_pulses[mic_count++] = (int)(clock - mic_last);
+    mic_last = clock;
+}
+
+// Конец кадра: давно нет перепадов - блок закончен
+void Z80Spectrum::mic_check() {
+
+    if (mic_edges && cpu_clock - mic_last > SAVE_GAP) mic_block();
+}
+
+// Блок из накопленных импульсов - в файл
+void Z80Spectrum::mic_block() {
+
+    int size = 0;
+    unsigned char* data = (unsigned char*) malloc(mic_count / 16 + 1);
+
+    if (mic_decode(data, size)) {
+        save_block(data, size);
+    }
+    else if (mic_count < SAVE_DR_MIN) {
+        // Одиночные щелчки MIC (звук, бордюр) - не запись
+    }
+    else if (save_tzx) {
+        save_direct();
+    }
+    else {
+        printf("tape: non-standard block of %d pulses is not saved, use .tzx for direct recording\n", mic_count);
+    }
+
+    free(data);
+
+    mic_edges = 0;
+    mic_count = 0;
+}
+
+// Импульсы -> байты по таймингам ПЗУ; 0 - блок нестандартный
+int Z80Spectrum::mic_decode(unsigned char* data, int& size) {
+
+    int* p = mic_pulses;
+    int  n = mic_count, i = 0, bits = 0;
+
+    while (i < n && save_near(p[i], TAPE_PILOT)) i++;
+
+    if (i < SAVE_PILOT_MIN || i + 2 > n) return 0;
+    if (!save_near(p[i], TAPE_SYNC1) || !save_near(p[i + 1], TAPE_SYNC2)) return 0;
+
+    // Бит - два одинаковых импульса. Лишний импульс в конце - либо первая
+    // половина последнего бита, не закрытая перепадом (тогда он равен
+    // второй), либо хвост до восстановления бордюра после SA-BYTES
+    for (i += 2; i < n; i += 2) {
+
+        if (i + 1 == n && bits % 8 == 0) break;
+
+        int a = p[i], b = i + 1 < n ? p[i + 1] : a;
+        int bit;
+
+        if      (save_near(a, TAPE_BIT0) && save_near(b, TAPE_BIT0)) bit = 0;
+        else if (save_near(a, TAPE_BIT1) && save_near(b, TAPE_BIT1)) bit = 1;
+        else return 0;
+
+        data[bits / 8] = (data[bits / 8] << 1) | bit;
+        bits++;
+    }
+
+    if (bits == 0 || bits % 8) return 0;
+
+    size = bits / 8;
+    return 1;
+}
+
+// Стандартный блок: флаг, данные, контрольная сумма
+void Z80Spectrum::save_block(const unsigned char* data, int size) {
+
+    unsigned char head[5] = { 0x10, 1000 & 255, 1000 >> 8, (unsigned char) size, (unsigned char)(size >> 8) };
+
+    // В TAP только длина
+    if (save_tzx) fwrite(head, 1, 5, save_file); else fwrite(head + 3, 1, 2, save_file);
+
+    fwrite(data, 1, size, save_file);
+    fflush(save_file);
+
+    save_blocks++;
+    printf("tape: saved block %d, flag %02X, %d bytes\n", save_blocks, data[0], size);
+}
+
+// TZX 0x15: импульсы блока семплами по SAVE_DR_RATE тактов
+void Z80Spectrum::save_direct() {
+
+    long long total = 0;
+    for (int _i = 0; _i < mic_count; _i++) total += mic_pulses[_i];
+
+    long long samples = total / SAVE_DR_RATE + 1;
+    int       size    = (int)((samples + 7) / 8);
+
+    // Длина блока - 3 байта
+    if (size > 0xFFFFFF) { printf("tape: direct recording is too long\n"); return; }
+
+    unsigned char* data  = (unsigned char*) calloc(size, 1);
+    int            level = !mic_level;
+    long long      t     = 0;
+
+    for (int _i = 0; _i < mic_count; _i++) {
+
+        long long from = t / SAVE_DR_RATE, to = (t + mic_pulses[_i]) / SAVE_DR_RATE;
+
+        if (level) for (long long _s = from; _s < to; _s++) data[_s >> 3] |= 0x80 >> (_s & 7);
+
+        t    += mic_pulses[_i];
+        level = !level;
+    }
+
+    // Последний семпл - уровень после последнего перепада
+    if (level) data[(samples - 1) >> 3] |= 0x80 >> ((samples - 1) & 7);
+
+    int last = samples % 8 ? samples % 8 : 8;
+
+    unsigned char head[9] = { 0x15, SAVE_DR_RATE, 0, 1000 & 255, 1000 >> 8, (unsigned char) last,
+                              (unsigned char) size, (unsigned char)(size >> 8), (unsigned char)(size >> 16) };
+
+    fwrite(head, 1, sizeof(head), save_file);
+    fwrite(data, 1, size, save_file);
+    fflush(save_file);
+
+    free(data);
+
+    save_blocks++;
+    printf("tape: saved block %d, direct recording %d pulses\n", save_blocks, mic_count);
+}
+
+// Вызов SA-BYTES (0x04C2 в ПЗУ 48K) выполняется сразу: A - флаг, IX/DE -
+// данные. Регистры на выходе - как после ПЗУ, возврат по адресу со стека
+void Z80Spectrum::save_trap() {
+
+    // Только ПЗУ 48K, не TR-DOS
+    if (trdos_latch || !(port_7ffd & 0x30)) return;
+
+    int len = d*256 + e;
+    unsigned char* data = (unsigned char*) malloc(len + 2);
+
+    data[0] = a;
+
+    int parity = a;
+
+    for (int _i = 0; _i < len; _i++) {
+
+        data[1 + _i] = mem_read((ix + _i) & 0xffff);
+        parity ^= data[1 + _i];
+    }
+
+    data[len + 1] = parity;
+
+    // Перепады, начатые до вызова, - отдельный блок
+    mic_take();
+    if (mic_edges) mic_block();
+
+    save_block(data, len + 2);
+    free(data);
+
+    // SA-8-BITS: IX за контрольной суммой, DE=FFFF, B=0, A=0 после INC A
+    ix = (ix + len + 1) & 0xffff;
+    d  = e = 0xff;
+    b  = 0;
+    a  = 0;
+
+    flags.Z = 1;
+    flags.C = 1;
+
+    // SA/LD-RET: бордюр из BORDCR, прерывания разрешены
+    border_id = (mem_read(0x5C48) >> 3) & 7;
+    iff1 = iff2 = 1;
+
+    pc = pop_word();
+}
+
+// Конец записи: недописанный блок - в файл
+void Z80Spectrum::save_close() {
+
+    if (mic_edges) mic_block();
+
+    fclose(save_file);
+    save_file = NULL;
+}
@@ -14,13 +14,31 @@ void Z80Spectrum::frame() {
     int rows_paper    = 64;    // 64       | 80
     int cols_paper    = 200;   // 200      | 68
     int irq_row       = 304;   // 296      | 304
-    int ppu_x = 0, ppu_y = 0, ay_state = 0;
-    
-    max_audio_cycle = max_tstates*50; // всего циклов за секунду
+    int ppu_x = 0, ppu_y = 0;
 
     // Автоматическое нажимание на клавиши
     autostart_macro();
 
+    // Кадр будет показан или записан? Если нет - точки не рисуются вовсе.
+    // При загрузке с ленты показывается только каждый TAPE_TURBO_SHOW-й
+    frame_render = (sdl_enable && !(tape_turbo && frame_counter % TAPE_TURBO_SHOW)) ||
+                   (record_file && autostart <= 1 && skip_first_frames == 0);
+
+    // AY синтезируется, только если звук кто-то слушает или пишет;
+    // при загрузке с ленты звук не слушают
+    ay_synth = (wave_file != NULL) || (sdl_enable && !sdl_disable_sound && !tape_turbo);
+
+    // Записи в AY, сделанные вне кадра (пошаговая отладка)
+    for (int _i = 0; _i < ay_event_count; _i++) ay_apply(ay[ay_events[_i].reg >> 4], ay_events[_i].reg & 15, ay_events[_i].data);
+    ay_event_count = 0;
+    ay_t_pos       = 0;
+
+    // Так же перепады бипера: звука за ними нет, важен только уровень
+    if (save_file) mic_take();
+    if (beep_edge_count) beep_level = beep_edges[beep_edge_count - 1].bits;
+    beep_edge_count = 0;
+    mic_seen        = 0;
+
     // Всегда сбрасывать в начале кадра (чтобы демки работали)
     t_states_cycle = 0;
     // отдельно считаем такты ЦПУ, дабы отвязать его него привязки остального оборудования
@@ -47,23 +65,34 @@ void Z80Spectrum::frame() {
 
         // Вход в TRDOS
         trdos_handler();        
+        // Быстрая загрузка: вход в LD-BYTES
+        if (pc == 0x0556 && tape_flash) tape_trap();
+        if (pc == 0x04C2 && tape_flash && save_file) save_trap();
+        int t_states = 8; //
+
         // Исполнение инструкции
         if (t_states_cpu < max_tstates) {
-            int i = run_instruction();
+
+            // Цикл ожидания перепада на ленте - сразу до перепада
+            int used = 1;
+            int i    = start_tape ? tape_edge_loop((max_tstates - t_states_cycle) / 8 - 1, max_tstates - t_states_cpu, used) : 0;
+
+            if (i == 0) i = run_instruction();
+
             t_states_cpu += i;
+            cpu_clock    += i;
+            t_states      = 8 * used;
         }
 
-        int t_states = 8; //
         t_states_cycle += t_states;
         t_states_all += t_states;
         
 
-        // 1 CPU (3.5МГц) = 2 PPU (7 МГц) 
+        // 1 CPU (3.5МГц) = 2 PPU (7 МГц); AY считается отдельно, по событиям
+        // Кадр никуда не выводится: луч не отслеживается
+        if (frame_render)
         for (int w = 0; w < t_states; w++) {
 
-            // Каждые 32 тика срабатывает AY-чип 3.5МГц / 32
-            if (((ay_state++) & 0x1f) == 0) ay_tick();
-
             // Видимая рисуемая область
             int ppu_vx = ppu_x - 72,
                 ppu_lx = ppu_x - 48;
@@ -89,11 +118,17 @@ void Z80Spectrum::frame() {
                 ppu_y++;
             }
         }
+    }
+
+    // Перепады бипера кадра, досчитать AY до конца кадра и получить семплы
+    beep_frame();
 
-        // Запись в wav звука (учитывая автостарт)
-        ay_sound_tick(t_states, audio_c);
+    if (ay_synth) {
+
+        ay_sync(max_tstates);
+        audio_c = audio_end_frame();
     }
-    printf("%d %d\n", t_states_cycle, t_states_cpu );
+    ay_t_pos = 0;
 
     t_states_cycle -= max_tstates;
 
@@ -106,9 +141,23 @@ void Z80Spectrum::frame() {
         flash_state   = !flash_state;
     }
 
+    // Кадр в записи регистров AY и в журнале звука
+    if (psg_file) psg_waits++;
+    if (aev_file) aev_frame(max_tstates);
+
     // При наличии опции автостарта не кодировать PNG
     if (autostart <= 1) encodebmp(audio_c);
 
+    // Загрузка ли это с ленты
+    tape_turbo_check();
+    if (save_file) mic_check();
+    if (spi_dirty) spi_timer();
+
+#ifndef NO_SDL
+    // Непоказанный кадр не рисовался: в выводе остается предыдущий
+    if (frame_render) tb_dirty = 1;
+#endif
+
     frame_counter++;
 }
 
@@ -192,6 +241,7 @@ void Z80Spectrum::cls(int cl) {
         printf("Clear = %d\r\n",cl);        
         for (int _i = 0; _i < 9*320*240; _i++)
             pixels[_i] = color;
+        tb_dirty = 1;
     }
 #endif
 }
@@ -201,10 +251,44 @@ void Z80Spectrum::pixel(int x, int y, Uint32 color) {
     //if (sdl_enable && sdl_renderer) {
        //printf("pixel x=%d y=%d c=%d\r\n", x, y, color);
        pixels[x + 3*320*y] = color;             
+       tb_dirty = 1;
     //}
 #endif
 }
 
+#ifndef NO_SDL
+// Отдать задний буфер на вывод и взять взамен средний (поток эмуляции)
+void Z80Spectrum::tb_publish() {
+
+    int prev = tb_state.exchange(tb_back | TB_FRESH, std::memory_order_acq_rel);
+
+    tb_back  = prev & 3;
+    pixels   = tb_frames[tb_back];
+    tb_dirty = 0;
+
+    // Разбудить поток вывода; кадр, который он еще не забрал, уже ждет события
+    if (!(prev & TB_FRESH) && tb_event != (Uint32) -1) {
+
+        SDL_Event fresh;
+        SDL_zero(fresh);
+        fresh.type = tb_event;
+        SDL_PushEvent(&fresh);
+    }
+}
+
+// Забрать свежий кадр из среднего буфера в передний (поток вывода)
+int Z80Spectrum::tb_acquire() {
+
+    if ((tb_state.load(std::memory_order_acquire) & TB_FRESH) == 0)
+        return 0;
+
+    int prev = tb_state.exchange(tb_front, std::memory_order_acq_rel);
+
+    tb_front = prev & 3;
+    return 1;
+}
+#endif
+
 // Установка точки
 void Z80Spectrum::pset(int x, int y, Uint32 color) {
 
@@ -240,7 +324,57 @@ void Z80Spectrum::pset(int x, int y, Uint32 color) {
 // Сохранение звука и видео
 // -----------------------------------------------------------------
 
-void Z80Spectrum::encodebmp(int audio_c) {
+// Палитра BMP (BGR0)
+static const unsigned char bmp_colors[64] = {
+    0x00, 0x00, 0x00, 0x00, // 0
+    0xc0, 0x00, 0x00, 0x00, // 1
+    0x00, 0x00, 0xc0, 0x00, // 2
+    0xc0, 0x00, 0xc0, 0x00, // 3
+    0x00, 0xc0, 0x00, 0x00, // 4
+    0xc0, 0xc0, 0x00, 0x00, // 5
+    0x00, 0xc0, 0xc0, 0x00, // 6
+    0xc0, 0xc0, 0xc0, 0x00, // 7
+    0x00, 0x00, 0x00, 0x00, // 8
+    0xff, 0x00, 0x00, 0x00, // 9
+    0x00, 0x00, 0xff, 0x00, // 10
+    0xff, 0x00, 0xff, 0x00, // 11
+    0x00, 0xff, 0x00, 0x00, // 12
+    0xff, 0xff, 0x00, 0x00, // 13
+    0x00, 0xff, 0xff, 0x00, // 14
+    0xff, 0xff, 0xff, 0x00  // 15
+};
+
+// Нарисовать кадр целиком из памяти (для кадров, которые не рисовались лучом)
+void Z80Spectrum::render_ram() {
+
+    for (int y = 0; y < 240; y++)
+    for (int x = 0; x < 320; x++) {
+
+        if (x < 32 || y < 24 || x >= 288 || y >= 216)
+            pset(x + 16, y + 24, border_id);
+    }
+
+    for (int _a = 0x4000; _a < 0x5800; _a++)
+        update_charline(_a);
+}
+
+// Снимок экрана в BMP-файл
+void Z80Spectrum::savebmp(const char* filename) {
+
+    struct BITMAPFILEHEADER head = {0x4D42, 38518, 0, 0, 0x76};
+    struct BITMAPINFOHEADER info = {0x28, 320, 240, 1, 4, 0, 0x9600, 0xb13, 0xb13, 16, 0};
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) { fprintf(stderr, "Can't write file %s\n", filename); exit(1); }
+
+    fwrite(&head, 1, sizeof(struct BITMAPFILEHEADER), fp);
+    fwrite(&info, 1, sizeof(struct BITMAPINFOHEADER), fp);
+    fwrite(bmp_colors, 1, 64, fp);
+    fwrite(fb, 1, 160*240, fp);
+    fclose(fp);
+}
+
+void Z80Spectrum::encodebmp(int samples) {
 
     // Пропуск первых кадров
     if (skip_first_frames) {
@@ -248,46 +382,33 @@ void Z80Spectrum::encodebmp(int audio_c) {
         return;
     }
 
-    // Предыдущий кадр не отличается
-    if (skip_dup_frame && diff_prev_frame == 0)
+    // Предыдущий кадр не отличается (skip_dup_frame=2: повторы только отслеживаются для -Q dup)
+    if (skip_dup_frame == 1 && diff_prev_frame == 0)
         return;
 
     struct BITMAPFILEHEADER head = {0x4D42, 38518, 0, 0, 0x76};
     struct BITMAPINFOHEADER info = {0x28, 320, 240, 1, 4, 0, 0x9600, 0xb13, 0xb13, 16, 0};
-    unsigned char colors[64] = {
-        0x00, 0x00, 0x00, 0x00, // 0
-        0xc0, 0x00, 0x00, 0x00, // 1
-        0x00, 0x00, 0xc0, 0x00, // 2
-        0xc0, 0x00, 0xc0, 0x00, // 3
-        0x00, 0xc0, 0x00, 0x00, // 4
-        0xc0, 0xc0, 0x00, 0x00, // 5
-        0x00, 0xc0, 0xc0, 0x00, // 6
-        0xc0, 0xc0, 0xc0, 0x00, // 7
-        0x00, 0x00, 0x00, 0x00, // 8
-        0xff, 0x00, 0x00, 0x00, // 9
-        0x00, 0x00, 0xff, 0x00, // 10
-        0xff, 0x00, 0xff, 0x00, // 11
-        0x00, 0xff, 0x00, 0x00, // 12
-        0xff, 0xff, 0x00, 0x00, // 13
-        0x00, 0xff, 0xff, 0x00, // 14
-        0xff, 0xff, 0xff, 0x00  // 15
-    };
-
-    if (record_file) {
-
-        fwrite(&head, 1, sizeof(struct BITMAPFILEHEADER), record_file);
-        fwrite(&info, 1, sizeof(struct BITMAPINFOHEADER), record_file);
-        fwrite(&colors, 1, 64, record_file);
-        fwrite(fb, 1, 160*240, record_file);
-    }
 
-    // Запись некоторого количества фреймов в аудиобуфер
-    if (audio_c && wave_file) {
+    // Кадр копируется в буфер очереди, на диск его пишет поток записи
+    RecSlot* slot = record_file ? rec_get(1) : NULL;
+
+    if (slot && video_format != VIDEO_BMP) {
+
+        encodeframe(slot);
+        rec_put(slot, record_file);
+    }
+    else if (slot) {
 
-        fwrite(audio_frame, 1, audio_c, wave_file);
-        wav_cursor += audio_c;
+        rec_append(slot, &head, sizeof(struct BITMAPFILEHEADER));
+        rec_append(slot, &info, sizeof(struct BITMAPINFOHEADER));
+        rec_append(slot, bmp_colors, 64);
+        rec_append(slot, fb, 160*240);
+        rec_put(slot, record_file);
     }
 
+    // Звук кадра - в блок WAV
+    if (samples && wave_file) wav_write(samples);
+
     // Копировать предыдущий кадр
     if (skip_dup_frame) {
 
@@ -296,26 +417,44 @@ void Z80Spectrum::encodebmp(int audio_c) {
     }
 }
 
-// Запись заголовка
-void Z80Spectrum::waveFmtHeader() {
-
-    struct WAVEFMTHEADER head = {
-        0x46464952,
-        (wav_cursor + 0x24),
-        0x45564157,
-        0x20746d66,
-        16,     // 16=PCM
-        1,      // Тип
-        2,      // Каналы
-        44100,  // Частота дискретизации
-        88200,  // Байт в секунду
-        2,      // Байт на семпл (1+1)
-        8,      // Бит на семпл
-        0x61746164, // "data"
-        wav_cursor
-    };
-
-    fseek(wave_file, 0, SEEK_SET);
-    fwrite(&head, 1, sizeof(WAVEFMTHEADER), wave_file);
+// Потоковая запись кадра (Y4M или rgb24): заголовок только один раз в начале
+void Z80Spectrum::encodeframe(RecSlot* slot) {
+
+    int size = 320*240;
+
+    if (record_header == 0 && video_format == VIDEO_Y4M) {
+        slot->size = sprintf((char*) slot->data, "YUV4MPEG2 W320 H240 F%d:1 Ip A1:1 C444\n", con_frame_fps);
+    }
+    record_header = 1;
+
+    if (video_format == VIDEO_Y4M) rec_append(slot, "FRAME\n", 6);
+
+    // fb хранится снизу вверх по 2 точки в байте
+    unsigned char* dst = slot->data + slot->size;
+    for (int y = 0; y < 240; y++) {
+
+        unsigned char* src = fb + (239-y)*160;
+        for (int x = 0; x < 160; x++) {
+
+            int cl0 = src[x] >> 4, cl1 = src[x] & 15;
+
+            if (video_format == VIDEO_Y4M) {
+
+                dst[0]        = pal_yuv[cl0][0]; dst[1]          = pal_yuv[cl1][0];
+                dst[size]     = pal_yuv[cl0][1]; dst[size+1]     = pal_yuv[cl1][1];
+                dst[2*size]   = pal_yuv[cl0][2]; dst[2*size+1]   = pal_yuv[cl1][2];
+                dst += 2;
+
+            } else {
+
+                Uint32 c0 = get_color(cl0), c1 = get_color(cl1);
+
+                dst[0] = c0 >> 16; dst[1] = c0 >> 8; dst[2] = c0;
+                dst[3] = c1 >> 16; dst[4] = c1 >> 8; dst[5] = c1;
+                dst += 6;
+            }
+        }
+    }
 
+    slot->size += 3*size;
 }
@@ -0,0 +1,259 @@
+// -----------------------------------------------------------------
+// Запись звука в WAV / RF64
+// -----------------------------------------------------------------
+
+// Семплы кадра конвертируются в блок из пула записи; в очередь блок
+// уходит, когда заполнен (около секунды звука), поэтому fwrite редкий.
+// В файл заголовок дописывается в конце, в канал (-w -) сразу пишется
+// потоковый: размеры 0xFFFFFFFF, читать до конца.
+
+// Открыть файл: "-" - stdout
+void Z80Spectrum::wav_open(const char* filename) {
+
+    if (strcmp(filename, "-") == 0) {
+        wave_file = stdout;
+    } else {
+        wave_file = fopen(filename, "wb");
+    }
+
+    if (wave_file == NULL) { fprintf(stderr, "Can't open file %s for writing\n", filename); exit(1); }
+
+    wav_seekable = (fseek(wave_file, 0, SEEK_CUR) == 0);
+    wav_header   = 0;
+    wav_bytes    = 0;
+    wav_slot     = NULL;
+}
+
+// Заголовок: начальный (final=0) или окончательный с размерами
+void Z80Spectrum::waveFmtHeader(int final) {
+
+    int channels = wav_mono  ? 1 : 2;
+    int bytes    = wav_float ? 4 : 2;
+
+    struct WAVEFMTHEADER head = {
+        0x46464952,     // RIFF
+        0xFFFFFFFF,
+        0x45564157,     // WAVE
+        0x4B4E554A,     // JUNK
+        28,
+        0, 0, 0, 0,
+        0x20746d66,     // fmt
+        16,
+        (unsigned short) (wav_float ? 3 : 1),
+        (unsigned short) channels,
+        (unsigned int) audio_rate,
+        (unsigned int) (audio_rate * channels * bytes),
+        (unsigned short) (channels * bytes),
+        (unsigned short) (8 * bytes),
+        0x61746164,     // data
+        0xFFFFFFFF
+    };
+
+    if (final) {
+
+        unsigned long long riff = wav_bytes + sizeof(struct WAVEFMTHEADER) - 8;
+
+        // Не помещается в 32 бита: RF64, размеры в ds64
+        if (riff > 0xFFFFFFFFULL) {
+
+            head.chunkId       = 0x34364652;   // RF64
+            head.ds64Id        = 0x34367364;   // ds64
+            head.riffSize64    = riff;
+            head.dataSize64    = wav_bytes;
+            head.sampleCount64 = wav_bytes / head.blockAlign;
+        } else {
+
+            head.chunkSize     = (unsigned int) riff;
+            head.subchunk2Size = (unsigned int) wav_bytes;
+        }
+
+        fseek(wave_file, 0, SEEK_SET);
+    }
+
+    fwrite(&head, 1, sizeof(struct WAVEFMTHEADER), wave_file);
+}
+
+// Дописать n стереосемплов из audio_pcm
+void Z80Spectrum::wav_write(int n) {
+
+    int size = n * (wav_mono ? 1 : 2) * (wav_float ? 4 : 2);
+
+    // Частота известна только к первому кадру (-R, устройство SDL)
+    if (!wav_header) {
+
+        waveFmtHeader(0);
+        wav_header = 1;
+    }
+
+    if (wav_slot && wav_slot->size + size > REC_SLOT_SIZE) {
+
+        rec_put(wav_slot, wave_file);
+        wav_slot = NULL;
+    }
+
+    if (wav_slot == NULL) wav_slot = rec_get(0);
+
+    short* pcm = audio_pcm;
+    float* ft  = (float*) (wav_slot->data + wav_slot->size);
+    short* it  = (short*) (wav_slot->data + wav_slot->size);
+
+    if (wav_mono) {
+
+        for (int _i = 0; _i < n; _i++) {
+
+            int v = (pcm[2*_i] + pcm[2*_i + 1]) / 2;
+            if (wav_float) ft[_i] = v * (1.0f / 32768); else it[_i] = v;
+        }
+    }
+    else if (wav_float) {
+        for (int _i = 0; _i < 2*n; _i++) ft[_i] = pcm[_i] * (1.0f / 32768);
+    }
+    else {
+        memcpy(it, pcm, size);
+    }
+
+    wav_slot->size += size;
+    wav_bytes      += size;
+}
+
+// Отдать недописанный блок в очередь (до rec_stop)
+void Z80Spectrum::wav_close() {
+
+    if (wav_slot) rec_put(wav_slot, wave_file);
+    wav_slot = NULL;
+}
+
+// -----------------------------------------------------------------
+// Запись регистров AY (PSG)
+// -----------------------------------------------------------------
+
+// Вместо звука пишутся сами записи в AY: пары (регистр, значение) и
+// маркер 0xFF на каждое прерывание, 0xFE n - пропуск 4*n прерываний.
+// Синтез при этом не нужен, звуковое устройство не открывается.
+
+void Z80Spectrum::psg_open(const char* filename) {
+
+    static const unsigned char head[16] = { 'P', 'S', 'G', 0x1A, 0x10, 50 };
+
+    psg_file = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "wb");
+    if (psg_file == NULL) { fprintf(stderr, "Can't open file %s for writing\n", filename); exit(1); }
+
+    fwrite(head, 1, sizeof(head), psg_file);
+    sdl_disable_sound = 1;
+}
+
+// Дописать 1 или 2 байта в блок; полный блок уходит потоку записи
+void Z80Spectrum::psg_put(int a, int b, int n) {
+
+    if (psg_slot && psg_slot->size + 2 > REC_SLOT_SIZE) {
+
+        rec_put(psg_slot, psg_file);
+        psg_slot = NULL;
+    }
+
+    if (psg_slot == NULL) psg_slot = rec_get(0);
+
+    psg_slot->data[psg_slot->size++] = a;
+    if (n > 1) psg_slot->data[psg_slot->size++] = b;
+}
+
+// Маркеры прошедших кадров: 0xFE n за каждые 4*n, остаток - 0xFF
+void Z80Spectrum::psg_markers() {
+
+    while (psg_waits >= 4) {
+
+        int n = psg_waits / 4 > 255 ? 255 : psg_waits / 4;
+
+        psg_put(0xFE, n, 2);
+        psg_waits -= 4*n;
+    }
+
+    for (; psg_waits > 0; psg_waits--) psg_put(0xFF, 0, 1);
+}
+
+// Запись в регистр: сначала маркеры прошедших кадров
+void Z80Spectrum::psg_write(int reg, int data) {
+
+    // 14, 15 - порты ввода-вывода, к звуку не относятся
+    if (reg > 13) return;
+
+    psg_markers();
+    psg_put(reg, data, 2);
+}
+
+// Конец записи: оставшиеся маркеры и блок - в очередь (до rec_stop)
+void Z80Spectrum::psg_flush() {
+
+    psg_markers();
+
+    if (psg_slot) rec_put(psg_slot, psg_file);
+    psg_slot = NULL;
+}
+
+// -----------------------------------------------------------------
+// Журнал звуковых событий
+// -----------------------------------------------------------------
+
+// Все, из чего синтезируется звук: записи в регистры AY и перепады
+// бипера с тактом внутри кадра. По журналу aybench проигрывает звук
+// без эмуляции Z80. Журнал начинается на границе кадра с полного
+// состояния регистров, поэтому события до первого кадра не пишутся.
+
+void Z80Spectrum::aev_open(const char* filename) {
+
+    static const unsigned char head[AEV_HEADER] = { 'A', 'E', 'V', 0x1A, 1 };
+
+    aev_file = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "wb");
+    if (aev_file == NULL) { fprintf(stderr, "Can't open file %s for writing\n", filename); exit(1); }
+
+    fwrite(head, 1, sizeof(head), aev_file);
+    aev_started = 0;
+}
+
+// Дописать событие в блок; полный блок уходит потоку записи
+void Z80Spectrum::aev_put(int code, int data, int t) {
+
+    if (!aev_started) return;
+
+    if (aev_slot && aev_slot->size + AEV_RECORD > REC_SLOT_SIZE) {
+
+        rec_put(aev_slot, aev_file);
+        aev_slot = NULL;
+    }
+
+    if (aev_slot == NULL) aev_slot = rec_get(0);
+
+    unsigned char* p = aev_slot->data + aev_slot->size;
+
+    p[0] = code;
+    p[1] = data;
+    p[2] = t;
+    p[3] = t >> 8;
+    p[4] = t >> 16;
+
+    aev_slot->size += AEV_RECORD;
+}
+
+// Конец кадра длиной t тактов; первый - вместо маркера состояние
+void Z80Spectrum::aev_frame(int t) {
+
+    if (aev_started) {
+
+        aev_put(AEV_FRAME, 0, t);
+        return;
+    }
+
+    aev_started = 1;
+
+    for (int _c = 0; _c < ay_chips; _c++)
+    for (int _r = 0; _r < 14; _r++) aev_put((_c << 4) | _r, ay[_c].regs[_r], 0);
+
+    aev_put(AEV_BEEP, port_fe & 0x18, 0);
+}
+
+// Конец записи: блок - в очередь (до rec_stop)
+void Z80Spectrum::aev_flush() {
+
+    if (aev_slot) rec_put(aev_slot, aev_file);
+    aev_slot = NULL;
+}